@@ -1,22 +1,47 @@
+#define _GNU_SOURCE  // mremap, fallocate
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 typedef struct {
   char* buffer;
   size_t buffer_length;
   ssize_t input_length;
+
+  /* Read from stdin but not yet returned by read_input */
+  char* read_ahead;
+  size_t read_ahead_start;
+  size_t read_ahead_end;
 } InputBuffer;
 
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_NO_SUCH_TABLE,
+  EXECUTE_TABLE_EXISTS,
+  EXECUTE_CATALOG_FULL,
+  EXECUTE_STRING_TOO_LONG,
 } ExecuteResult;
 
 typedef enum {
@@ -32,7 +57,25 @@ typedef enum {
   PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
 
-typedef enum { STATEMENT_INSERT, STATEMENT_SELECT } StatementType;
+typedef enum {
+  STATEMENT_INSERT,
+  STATEMENT_SELECT,
+  STATEMENT_CREATE_INDEX,
+  STATEMENT_CREATE_TABLE
+} StatementType;
+
+#define TABLE_NAME_SIZE 31
+#define DEFAULT_TABLE_NAME "users"
+
+typedef enum { COLUMN_ID, COLUMN_USERNAME, COLUMN_EMAIL, NUM_COLUMNS } Column;
+
+typedef enum {
+  AGGREGATE_NONE,
+  AGGREGATE_COUNT,  // count(*)
+  AGGREGATE_MIN,    // min(id)
+  AGGREGATE_MAX,    // max(id)
+  AGGREGATE_SUM     // sum(id)
+} AggregateType;
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -42,45 +85,560 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
+/*
+ * Prepared statements
+ * A statement is compiled once into a short program for a register machine
+ * and cached by its text, so running the same text again skips parsing.
+ * A `?` where a value goes is a parameter; the values follow the statement
+ * after " ; ", in order:
+ *   select where id = ? ; 42
+ *   insert into orders ? ? ?, ? ? ? ; 1 alice a@x.com, 2 bob b@x.com
+ */
+typedef enum {
+  OP_INTEGER,       // r[p1] = p3
+  OP_STRING,        // r[p1] = the string at offset p3 of the program's strings
+  OP_VARIABLE,      // r[p1] = parameter p2
+  OP_ROW,           // add the row r[p1], r[p1 + 1], r[p1 + 2] to the insert
+  OP_INSERT,        // insert the rows added so far
+  OP_MATCH,         // select only rows whose column p2 equals r[p1]
+  OP_SELECT,        // ids r[p1] to r[p1 + 1], at most r[p1 + 2]; aggregate p2
+  OP_CREATE_INDEX,  // on column p2
+  OP_CREATE_TABLE   // username up to p2 bytes, email up to p3
+} Opcode;
+
+typedef struct {
+  uint8_t opcode;
+  uint8_t p1;
+  uint16_t p2;
+  uint32_t p3;
+} Instruction;
+
+#define PROGRAM_NUM_REGISTERS 4
+
+typedef struct {
+  uint32_t integer;
+  const char* text;  // NULL for an integer
+} Value;
+
+typedef struct {
+  char* text;  // the statement it was compiled from
+  StatementType type;
+  char table_name[TABLE_NAME_SIZE + 1];  // empty for DEFAULT_TABLE_NAME
+  Instruction* instructions;
+  uint32_t num_instructions;
+  uint32_t instructions_capacity;
+  char* strings;  // string literals, each followed by a terminator
+  uint32_t strings_size;
+  /* The column each parameter is bound to, which decides how it is checked */
+  uint8_t* parameter_columns;
+  uint32_t num_parameters;
+  uint32_t num_rows;  // rows an insert adds
+} Program;
+
+/* The statement's words while it is being compiled */
+typedef struct {
+  char** tokens;
+  uint32_t num_tokens;
+  uint32_t next;
+  Program* program;
+} Compiler;
+
+#define STATEMENT_CACHE_SIZE 256  // direct-mapped by a hash of the text
+
+typedef struct {
+  Program* programs[STATEMENT_CACHE_SIZE];
+  uint64_t hits;
+  uint64_t misses;
+} StatementCache;
+
+#define STATEMENT_INLINE_PARAMETERS 4
+
 typedef struct {
   StatementType type;
+  Program* program;  // owned by the statement cache
+  /* Bound values: inline_parameters unless there are more of them */
+  Value* parameters;
+  Value inline_parameters[STATEMENT_INLINE_PARAMETERS];
   Row row_to_insert;  // only used by insert statement
+  /* All rows of the insert: &row_to_insert unless it names several */
+  Row* rows_to_insert;
+  uint32_t num_rows_to_insert;
+  /* Only used by select: ids in [min_id, max_id], at most `limit` rows */
+  uint32_t min_id;
+  uint32_t max_id;
+  uint32_t limit;
+  AggregateType aggregate;  // select prints one value instead of the rows
+  /*
+  select: COLUMN_ID, or rows whose column equals match_value.
+  create index: the column to index.
+  */
+  Column match_column;
+  char match_value[COLUMN_EMAIL_SIZE + 1];
 } Statement;
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
+/*
+ * Row Record Layout
+ * The id, then each string as a one byte length followed by its
+ * characters, with no terminator or padding.
+ */
 #define ID_SIZE size_of_attribute(Row, id)
-#define USERNAME_SIZE size_of_attribute(Row, username)
-#define EMAIL_SIZE size_of_attribute(Row, email)
-#define ID_OFFSET 0
-#define USERNAME_OFFSET (ID_OFFSET + ID_SIZE)
-#define EMAIL_OFFSET (USERNAME_OFFSET + USERNAME_SIZE)
-#define ROW_SIZE (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
+#define STRING_LENGTH_SIZE sizeof(uint8_t)
+#define ROW_MAX_SIZE \
+    (ID_SIZE + 2 * STRING_LENGTH_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+
+/* Result output buffer, and room for one row however it is escaped */
+#define SINK_BUFFER_SIZE (256 * 1024)
+#define SINK_MAX_ROW_SIZE (2 * ROW_MAX_SIZE + 32)
 
-#define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 400
+/* Most worker threads a parallel scan may use */
+#define SCAN_MAX_THREADS 64
+
+/* Leaves a scan asks the kernel to read ahead of it, by default and at most */
+#define READAHEAD_DEFAULT_LEAVES 32
+#define READAHEAD_MAX_LEAVES 1024
+
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+
+/*
+ * Page size of the open database. It is read from the file header (or
+ * picked with --page-size when the file is created) before any page is
+ * touched, so the layout below is worked out at run time.
+ */
+uint32_t page_size = DEFAULT_PAGE_SIZE;
+#define PAGE_SIZE page_size
 
 #define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+
+/*
+ * Buffer pool sizing. With 510 keys per internal node the tree stays a few
+ * levels deep, and a split that climbs it unpins each level before the
+ * next, so one statement pins no more than a handful of pages. The most
+ * pinned at once comes from a parallel scan, whose SCAN_MAX_THREADS
+ * workers each pin the leaf they read, and a page or two on the way to
+ * it. The minimum leaves room for that and for the statement thread.
+ */
+#define DEFAULT_POOL_FRAMES 1024
+#define MIN_POOL_FRAMES (2 * SCAN_MAX_THREADS)
+
+/*
+ * The mmap pager maps a large address range up front so the mapping never
+ * has to move while the file grows, and grows the file in chunks.
+ */
+#define MMAP_RESERVE_BYTES ((size_t)1 << (sizeof(void*) == 8 ? 40 : 30))
+#define MMAP_GROW_PAGES 256
+
+typedef enum {
+  PAGER_BUFFERED,  // pread/pwrite through the buffer pool
+  PAGER_MMAP       // zero-copy pages straight out of a shared file mapping
+} PagerMode;
+
+typedef struct {
+  PagerMode mode;
+  uint32_t num_frames;  // buffer pool size, unused by PAGER_MMAP
+  bool use_wal;         // journal changes to <db>-wal, PAGER_BUFFERED only
+  uint32_t wal_group_size;
+  uint32_t page_size;   // only used when the file is created
+  bool compress_leaves;  // turn on leaf compression, kept in the header
+  bool compress_pages;   // turn on page compression, kept in the header
+} PagerOptions;
+
+/*
+ * Write-ahead log. Changed pages are appended to <db>-wal as full page
+ * images; the main file is only written by checkpoints, which copy the
+ * latest committed image of each page back into it. A frame whose db_size
+ * is non-zero is a commit frame and commits every frame before it.
+ */
+#define WAL_MAGIC 0x4c41574d  // "MWAL"
+#define WAL_VERSION 1
+#define WAL_DEFAULT_GROUP_SIZE 32     // statements per fsync
+#define WAL_COMMIT_WINDOW_MS 50       // oldest statement a group may hold back
+#define WAL_AUTOCHECKPOINT_FRAMES 1000
+/*
+ * Under a steady write load the background checkpoint never sees a quiet
+ * log it can restart, so past this size the writer checkpoints itself
+ */
+#define WAL_MAX_FRAMES (4 * WAL_AUTOCHECKPOINT_FRAMES)
+
+/*
+ * Without a WAL, dirty pages are written back to the main file every
+ * CHECKPOINT_INTERVAL_MS. Runs of consecutive pages go out in one pwritev.
+ */
+#define CHECKPOINT_INTERVAL_MS 1000
+#define WRITE_BATCH_PAGES 64
+
+/*
+ * Page compression. Pages other than the header may be stored in the main
+ * file as this header (magic, compressed length) plus an LZ image, with
+ * the rest of the page's slot punched out of the file, so a cold page only
+ * takes and reads back the blocks it needs. Page numbers still map to
+ * fixed offsets, and a slot without the magic holds a plain page. The
+ * magic can not start a node (type byte) or freelist trunk (page number).
+ */
+#define PAGE_COMPRESSED_MAGIC 0x505a4cff  // "\xffLZP"
+#define PAGE_COMPRESSED_HEADER_SIZE (2 * sizeof(uint32_t))
+#define FILE_BLOCK_SIZE 4096  // holes are punched in whole blocks
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+/*
+ * Snapshot reads. Before the writer's statement first touches a page that
+ * an open snapshot may still read, the page is copied into a version
+ * tagged with the statement's epoch. Versions are found by page number.
+ */
+#define VERSION_BUCKETS 1024
+
+/* Keys left after binary search for a node search to compare all at once */
+#define KEY_SEARCH_WINDOW 32
+
+/* Share of each leaf `.load` fills, leaving room for later inserts */
+#define LOAD_DEFAULT_FILL_PERCENT 90
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t salt;  // changes on every reset so stale frames never validate
+} WalHeader;
+
+typedef struct {
+  uint32_t page_num;
+  uint32_t db_size;  // pages in the database after a commit, 0 otherwise
+  uint32_t salt;
+  uint32_t checksum;
+} WalFrameHeader;
+
+#define WAL_FRAME_SIZE (sizeof(WalFrameHeader) + PAGE_SIZE)
+
+typedef struct {
+  int file_descriptor;
+  char* path;
+  uint32_t salt;
+
+  uint32_t num_frames;      // frames appended since the last reset
+  uint32_t num_committed;   // frames covered by the last durable commit
+  uint32_t backfilled;      // frames already copied into the main file
+  uint32_t committed_db_size;
+  uint32_t* frame_pages;    // page number held by each frame
+  uint32_t frame_capacity;
+  uint32_t* page_frames;    // latest frame + 1 for each page, 0 if none
+  uint32_t page_capacity;
+  uint64_t generation;      // bumped by every reset, which reuses the frames
+
+  /* Group commit: statements since the last fsync */
+  uint32_t group_size;
+  uint32_t pending_statements;
+  struct timespec group_start;
+
+  uint64_t commits;
+  uint64_t checkpoints;
+  uint64_t frames_written;
+
+  /*
+  Guards the fields above against the background checkpointer, which also
+  owns pager->file_length while it writes into the main file
+  */
+  pthread_mutex_t lock;
+  pthread_mutex_t checkpoint_lock;  // one checkpoint at a time
+} Wal;
+
+typedef struct {
+  uint32_t page_num;    // INVALID_PAGE_NUM when the frame holds no page
+  uint32_t pin_count;   // frames with pin_count > 0 are never evicted
+  bool dirty;           // must be written back before the frame is reused
+  bool referenced;      // CLOCK reference bit, set on every access
+  bool loading;         // a parallel scan worker is reading the page in
+  uint32_t readers;     // snapshot readers holding the page, never evicted
+  void* data;
+} Frame;
+
+/* A page as it was before the writer's statement `epoch` first touched it */
+typedef struct PageVersion {
+  uint32_t page_num;
+  uint64_t epoch;
+  void* data;
+  struct PageVersion* next;  // in the same bucket
+} PageVersion;
 
 typedef struct {
   int file_descriptor;
-  uint32_t file_length;
+  off_t file_length;
   uint32_t num_pages;
-  void* pages[TABLE_MAX_PAGES];
+  PagerMode mode;
+
+  /* PAGER_MMAP only */
+  void* map;
+  size_t map_length;
+
+  Frame* frames;
+  void* frame_data;     // num_frames * PAGE_SIZE bytes backing all frames
+  uint32_t num_frames;
+  uint32_t clock_hand;
+
+  /* Open-addressing hash table mapping page numbers to frame indexes */
+  uint32_t* page_table;
+  uint32_t page_table_capacity;  // power of two, at least 2 * num_frames
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  Wal* wal;  // NULL when changes go straight to the main file
+  /*
+  Held for the duration of every statement, so the background thread can
+  write back pages while the REPL is idle without racing the B-tree code
+  */
+  pthread_mutex_t lock;
+
+  /*
+  Set while a parallel scan runs under `lock`: get_page and pager_unpin then
+  go through pool_lock, and a miss reads its page with pool_lock dropped
+  */
+  bool shared;
+  pthread_mutex_t pool_lock;
+  pthread_cond_t page_loaded;
+
+  /*
+  Snapshot readers, guarded by pool_lock. epoch counts the statements run
+  under `lock`; a snapshot sees the database as it was after the one it
+  started at. While any is open, get_page and pager_unpin go through
+  pool_lock as for a parallel scan.
+  */
+  uint64_t epoch;
+  uint64_t* snapshot_epochs;  // of the open snapshots
+  uint32_t num_snapshots;
+  uint32_t snapshot_capacity;
+  PageVersion** versions;  // VERSION_BUCKETS chains
+  uint32_t num_versions;
+  pthread_cond_t page_released;  // a frame's last snapshot reader let go
+
+  /* Background write-back thread, PAGER_BUFFERED only */
+  pthread_t background;
+  pthread_mutex_t background_lock;
+  pthread_cond_t background_wake;
+  bool background_running;
+  bool stopping;
+  struct timespec last_checkpoint;
+  uint64_t checkpoints;
+  uint64_t pages_written;
+  uint64_t pages_compressed;  // of pages_written
+
+  bool compress_pages;  // set from the header by db_open
 } Pager;
 
+/* A page a snapshot is reading: a frame it holds, a private copy, or a version */
+typedef struct {
+  uint32_t page_num;
+  uint32_t frame_index;  // INVALID_FRAME unless it holds a frame
+  void* copy;            // read past the buffer pool, freed on release
+} HeldPage;
+
+/*
+A reader's consistent view of the database: every page as it was after
+statement `epoch`. The pages it holds are released when it ends.
+*/
+typedef struct {
+  uint64_t epoch;
+  HeldPage* held;
+  uint32_t num_held;
+  uint32_t held_capacity;
+} Snapshot;
+
 typedef struct {
   Pager* pager;
+  char name[TABLE_NAME_SIZE + 1];
+  uint32_t catalog_page_num;  // where the table's entry lives, and which one
+  uint32_t catalog_slot;
   uint32_t root_page_num;
+  bool compress_leaves;  // rebuilt leaves get an email domain dictionary
+  uint32_t index_roots[NUM_COLUMNS];  // secondary index per column, 0 if none
+  uint16_t column_sizes[NUM_COLUMNS];  // widest value of each column, from the catalog
+  uint32_t scan_threads;  // full scans are split over this many threads
+  uint32_t readahead_leaves;  // leaves read ahead of a scan, 0 for none
+  bool scan_unordered;    // workers write as they go instead of in key order
 } Table;
 
+/*
+An open database file: its pager and the tables listed in its catalog.
+Table handles stay put for as long as the file is open.
+*/
+typedef struct {
+  Pager* pager;
+  uint32_t catalog_page_num;
+  Table* tables;  // room for CATALOG_MAX_TABLES, in catalog order
+  uint32_t num_tables;
+  bool compress_leaves;  // from the header, for every table
+} Database;
+
+#define BTREE_MAX_DEPTH 32
+
+/*
+The internal nodes a descent passed through, root first. A split hands its
+new node to the parent found here rather than through a parent pointer. An
+entry may since have split itself; the parent is then found by moving right
+from it, as a descent would.
+*/
+typedef struct {
+  uint32_t pages[BTREE_MAX_DEPTH];
+  uint32_t depth;  // internal levels above the leaf
+} TreePath;
+
+/*
+Read-ahead for a walk along the leaf chain. A leaf only names the one
+after it, so the leaves coming up are taken from their parent instead,
+starting from the one on the cursor's path and following right links.
+*/
+typedef struct {
+  uint32_t window;           // leaves to keep ahead, 0 when off
+  uint32_t parent_page_num;  // parent of the next leaf to advise, 0 at the end
+  uint32_t child_index;      // that leaf's index in the parent
+  uint32_t ahead;            // leaves advised that the walk has not reached
+} ReadAhead;
+
 typedef struct {
   Table* table;
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;  // Indicates a position one past the last element
+  TreePath path;      // from the root to the leaf's parent
+  ReadAhead readahead;  // set up by table_start and table_seek
 } Cursor;
 
+typedef struct {
+  char* domain;     // points into a row's email, NULL for a free slot
+  uint32_t length;
+  uint32_t count;   // rows in the leaf with this domain
+  uint8_t index;    // dictionary index, LEAF_DICTIONARY_NONE while inline
+} LeafDomain;
+
+/*
+Running size of a leaf being filled with rows in key order, and with
+compression the email domains seen so far. A domain goes into the
+dictionary the second time it shows up, while the dictionary has room.
+*/
+typedef struct {
+  bool compress;
+  uint32_t size;            // bytes of slots, records and dictionary
+  LeafDomain* domains;      // open addressing on the domain
+  uint32_t domain_capacity;
+  uint32_t* claimed;        // slots in use, so a reset only clears those
+  uint32_t num_claimed;
+  LeafDomain** entries;     // dictionary in index order
+  uint32_t num_entries;
+} LeafPlan;
+
+typedef enum { OUTPUT_TABLE, OUTPUT_CSV, OUTPUT_TSV, OUTPUT_BINARY } OutputMode;
+
+/*
+Where select writes its rows. Rows are formatted straight from the leaf
+records into one large buffer, which leaves in a single write() whenever it
+fills up instead of going through printf a row at a time.
+*/
+typedef struct {
+  OutputMode mode;
+  int file_descriptor;  // STDOUT_FILENO unless .output named a file, -1 to
+                        // keep every row in memory
+  char* buffer;
+  uint32_t used;
+  uint32_t capacity;
+  pthread_mutex_t* write_lock;  // shared by scan workers writing to one file
+} ResultSink;
+
+/* One worker of a parallel scan: the rows with ids in [min_id, max_id] */
+typedef struct {
+  Table* table;
+  uint32_t min_id;
+  uint32_t max_id;
+  ResultSink sink;
+  pthread_t thread;
+} ScanWorker;
+
+/*
+ * Server Protocol
+ * A request is a u32 length followed by that many bytes of statement text,
+ * `?` values included. A response is a u8 ResponseStatus, a u32 length and
+ * that many bytes: the selected rows in binary output mode when it is
+ * RESPONSE_OK, otherwise the error message. Integers are in host order.
+ */
+typedef enum { RESPONSE_OK, RESPONSE_ERROR } ResponseStatus;
+
+#define REQUEST_HEADER_SIZE sizeof(uint32_t)
+#define RESPONSE_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+#define SERVER_MAX_REQUEST_SIZE (1024 * 1024)
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE (64 * 1024)
+
+/* A client connection of the server */
+typedef struct Session {
+  int file_descriptor;
+  uint32_t events;  // what epoll is watching for
+  char* input;      // received bytes, starting at a request header
+  uint32_t input_used;
+  uint32_t input_capacity;
+  char* output;  // responses, of which output_sent bytes have gone out
+  size_t output_used;
+  size_t output_sent;
+  size_t output_committed;  // the part that may go out, the rest waits for a commit
+  size_t output_capacity;
+  bool busy;     // a reader thread is running its select, stop reading meanwhile
+  bool closing;  // the client went away while it was busy
+  struct Session* previous;
+  struct Session* next;
+} Session;
+
+/* A select handed to a reader thread, and then its response */
+typedef struct ReadJob {
+  Session* session;
+  char* text;
+  uint32_t length;
+  ResponseStatus status;
+  char* response;
+  uint32_t response_length;
+  struct ReadJob* next;
+} ReadJob;
+
+/*
+Threads that run the server's selects against snapshots, so they go on
+while the event loop thread runs inserts. Jobs are taken in order from
+`queue`; finished ones are put on `done` and done_event is signalled.
+*/
+typedef struct {
+  Database* database;
+  pthread_t* threads;
+  uint32_t num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  ReadJob* queue;
+  ReadJob* queue_tail;
+  ReadJob* done;
+  int done_event;  // eventfd the event loop watches
+  bool stopping;
+} ReaderPool;
+
+#define BENCH_DEFAULT_CLIENTS 4
+#define BENCH_DEFAULT_REQUESTS 10000
+#define BENCH_DEFAULT_READ_PERCENT 50
+#define BENCH_SEARCH_NODES 4096  // more keys than the caches hold, like a real tree
+#define BENCH_SEARCH_COUNT 1000000
+
+/* One connection of the load generator */
+typedef struct {
+  const char* socket_path;
+  uint32_t num_requests;
+  uint32_t read_percent;
+  uint32_t first_id;     // inserts use ids from here on
+  uint32_t max_read_id;  // selects pick ids from 1 to this
+  uint32_t reads;        // selects sent, none when the table was empty
+  uint64_t* latencies;   // nanoseconds, one per request
+  uint32_t errors;
+  unsigned int seed;
+  pthread_t thread;
+} BenchClient;
+
 void print_row(Row* row) {
   printf("(%d, %s, %s)\n", row->id, row->username, row->email);
 }
@@ -94,62 +652,178 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 const uint32_t NODE_TYPE_OFFSET = 0;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint8_t COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE;
 */
 #define NODE_TYPE_SIZE sizeof(uint8_t)
 #define NODE_TYPE_OFFSET 0
 #define IS_ROOT_SIZE sizeof(uint8_t)
 #define IS_ROOT_OFFSET  (NODE_TYPE_SIZE)
-#define PARENT_POINTER_SIZE sizeof(uint32_t)
-#define PARENT_POINTER_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE)
-#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
+#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE)
+/*
+ * B-link Header Layout
+ * Leaves and internal nodes of a table (Lehman and Yao). Every node but the
+ * last on its level links to its right sibling and has a high key, the
+ * largest key it may hold; a split gives the new right half the old node's
+ * link and high key before the old node points at it. A descent that finds
+ * its key above a node's high key has raced a split and moves right, so it
+ * never needs the parent and the child latched together. 0 ends a level,
+ * and the high key of its last node means nothing.
+ */
+#define NODE_RIGHT_LINK_SIZE sizeof(uint32_t)
+#define NODE_RIGHT_LINK_OFFSET (COMMON_NODE_HEADER_SIZE)
+#define NODE_HIGH_KEY_SIZE sizeof(uint32_t)
+#define NODE_HIGH_KEY_OFFSET (NODE_RIGHT_LINK_OFFSET + NODE_RIGHT_LINK_SIZE)
+#define BLINK_NODE_HEADER_SIZE \
+    (COMMON_NODE_HEADER_SIZE + NODE_RIGHT_LINK_SIZE + NODE_HIGH_KEY_SIZE)
 /*
  * Internal Node Header Layout
  */
 #define INTERNAL_NODE_NUM_KEYS_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_NUM_KEYS_OFFSET (COMMON_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_NUM_KEYS_OFFSET (BLINK_NODE_HEADER_SIZE)
 #define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_RIGHT_CHILD_OFFSET \
     (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
 #define INTERNAL_NODE_HEADER_SIZE \
-    (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
+    (BLINK_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
 
 /*
  * Internal Node Body Layout
+ * All the keys first, then all the children, so a search only touches the
+ * contiguous key array.
  */
 #define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_CELL_SIZE \
     (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
-#define INTERNAL_NODE_MAX_KEYS 3
+#define INTERNAL_NODE_SPACE_FOR_CELLS (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE)
+/*
+Building with -DINTERNAL_NODE_KEYS_LIMIT=3 gives back the fan-out of 4
+internal nodes had before it was derived from the page size, to compare
+the two with --bench-tree
+*/
+#ifdef INTERNAL_NODE_KEYS_LIMIT
+#define INTERNAL_NODE_MAX_KEYS INTERNAL_NODE_KEYS_LIMIT
+#else
+#define INTERNAL_NODE_MAX_KEYS (INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE)
+#endif
+#define INTERNAL_NODE_KEYS_OFFSET (INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_CHILDREN_OFFSET \
+    (INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_KEYS * INTERNAL_NODE_KEY_SIZE)
 
 /*
  * Leaf Node Header Layout
+ * A leaf's right link is the next leaf, which scans follow.
  */
 #define LEAF_NODE_NUM_CELLS_SIZE sizeof(uint32_t)
-#define LEAF_NODE_NUM_CELLS_OFFSET (COMMON_NODE_HEADER_SIZE)
-#define LEAF_NODE_NEXT_LEAF_SIZE sizeof(uint32_t)
-#define LEAF_NODE_NEXT_LEAF_OFFSET \
+#define LEAF_NODE_NUM_CELLS_OFFSET (BLINK_NODE_HEADER_SIZE)
+#define LEAF_NODE_CONTENT_START_SIZE sizeof(uint32_t)
+#define LEAF_NODE_CONTENT_START_OFFSET \
     (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_DICTIONARY_SIZE sizeof(uint32_t)
+#define LEAF_NODE_DICTIONARY_OFFSET \
+    (LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE)
 #define LEAF_NODE_HEADER_SIZE \
-    (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE)
+    (BLINK_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + \
+     LEAF_NODE_CONTENT_START_SIZE + LEAF_NODE_DICTIONARY_SIZE)
 
 /*
  * Leaf Node Body Layout
+ * A slotted page: the keys in order, then the record offset of each key,
+ * grow up from the header, and the records themselves are packed down from
+ * the end of the page. The gap between the two is the free space. Keeping
+ * the keys contiguous lets a search scan them a cache line at a time.
  */
 #define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
-#define LEAF_NODE_KEY_OFFSET 0
-#define LEAF_NODE_VALUE_SIZE (ROW_SIZE)
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
+#define LEAF_NODE_OFFSET_SIZE sizeof(uint32_t)
+#define LEAF_NODE_SLOT_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_OFFSET_SIZE)
 #define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-#define LEAF_NODE_LEFT_SPLIT_COUNT \
-    ((LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT)
+#define LEAF_NODE_MAX_CELL_SIZE \
+    (LEAF_NODE_SLOT_SIZE + ROW_MAX_SIZE + LEAF_DOMAIN_INDEX_SIZE)
+
+/*
+ * Leaf Dictionary Layout
+ * A compressed leaf has a nonzero dictionary offset. The dictionary holds
+ * email domains (from the '@' on) shared by its rows: a count, the offset
+ * of each entry from the start of the dictionary, then the entries as a
+ * one byte length and the characters. Each record in the leaf ends with
+ * a domain index; when it is not LEAF_DICTIONARY_NONE the stored email
+ * stops before the domain.
+ */
+#define LEAF_DICTIONARY_COUNT_SIZE sizeof(uint8_t)
+#define LEAF_DICTIONARY_ENTRY_OFFSET_SIZE sizeof(uint16_t)
+#define LEAF_DICTIONARY_MAX_ENTRIES 255
+#define LEAF_DICTIONARY_NONE 0xFF
+#define LEAF_DOMAIN_INDEX_SIZE sizeof(uint8_t)
+
+/*
+ * Index Node Layout
+ * A secondary index maps a column value to the ids of the rows holding it.
+ * Its entries are the value's hash in the high half and the id in the low
+ * half, kept sorted, so the rows sharing a value sit next to each other.
+ * Index nodes use the common header, then a count and a link (the next
+ * leaf, or the right child of an internal node). A leaf holds entries; an
+ * internal node holds separators, the largest entry under each child, and
+ * then the children.
+ */
+#define INDEX_NODE_COUNT_OFFSET (COMMON_NODE_HEADER_SIZE)
+#define INDEX_NODE_LINK_OFFSET (INDEX_NODE_COUNT_OFFSET + sizeof(uint32_t))
+#define INDEX_NODE_HEADER_SIZE (INDEX_NODE_LINK_OFFSET + sizeof(uint32_t))
+#define INDEX_ENTRY_SIZE sizeof(uint64_t)
+#define INDEX_LEAF_MAX_ENTRIES ((PAGE_SIZE - INDEX_NODE_HEADER_SIZE) / INDEX_ENTRY_SIZE)
+#define INDEX_INTERNAL_MAX_KEYS \
+    ((PAGE_SIZE - INDEX_NODE_HEADER_SIZE) / (INDEX_ENTRY_SIZE + sizeof(uint32_t)))
+#define INDEX_INTERNAL_CHILDREN_OFFSET \
+    (INDEX_NODE_HEADER_SIZE + INDEX_INTERNAL_MAX_KEYS * INDEX_ENTRY_SIZE)
+
+/*
+ * Database Header Layout (page 0)
+ */
+#define DB_MAGIC 0x4244594d  // "MYDB"
+#define DB_VERSION 6
+#define DB_MAGIC_OFFSET 0
+#define DB_VERSION_OFFSET (DB_MAGIC_OFFSET + sizeof(uint32_t))
+#define DB_PAGE_SIZE_OFFSET (DB_VERSION_OFFSET + sizeof(uint32_t))
+#define DB_CATALOG_PAGE_OFFSET (DB_PAGE_SIZE_OFFSET + sizeof(uint32_t))
+#define DB_FREELIST_TRUNK_OFFSET (DB_CATALOG_PAGE_OFFSET + sizeof(uint32_t))
+#define DB_FREELIST_COUNT_OFFSET (DB_FREELIST_TRUNK_OFFSET + sizeof(uint32_t))
+#define DB_FLAGS_OFFSET (DB_FREELIST_COUNT_OFFSET + sizeof(uint32_t))
+#define DB_FLAG_COMPRESS_LEAVES 0x1
+#define DB_FLAG_COMPRESS_PAGES 0x2
+
+/*
+ * Catalog Page Layout
+ * The tables of the file: a count, then one fixed-size entry per table
+ * with its name, its root page, the root of each column's secondary index
+ * (0 if none) and its columns, each a type and a size. Every table has the
+ * Row layout for now; the columns are recorded so that a file with some
+ * other layout is refused instead of misread.
+ */
+#define CATALOG_NUM_TABLES_OFFSET 0
+#define CATALOG_HEADER_SIZE sizeof(uint32_t)
+#define CATALOG_NAME_OFFSET 0
+#define CATALOG_NAME_SIZE (TABLE_NAME_SIZE + 1)
+#define CATALOG_ROOT_OFFSET (CATALOG_NAME_OFFSET + CATALOG_NAME_SIZE)
+#define CATALOG_INDEX_ROOTS_OFFSET (CATALOG_ROOT_OFFSET + sizeof(uint32_t))
+#define CATALOG_NUM_COLUMNS_OFFSET \
+    (CATALOG_INDEX_ROOTS_OFFSET + NUM_COLUMNS * sizeof(uint32_t))
+#define CATALOG_COLUMNS_OFFSET (CATALOG_NUM_COLUMNS_OFFSET + sizeof(uint32_t))
+#define CATALOG_COLUMN_SIZE (2 * sizeof(uint16_t))
+#define CATALOG_ENTRY_SIZE (CATALOG_COLUMNS_OFFSET + NUM_COLUMNS * CATALOG_COLUMN_SIZE)
+#define CATALOG_MAX_TABLES ((PAGE_SIZE - CATALOG_HEADER_SIZE) / CATALOG_ENTRY_SIZE)
+#define COLUMN_TYPE_INTEGER 1
+#define COLUMN_TYPE_TEXT 2
+
+/*
+ * Freelist Trunk Page Layout
+ * Free pages are recorded in a chain of trunk pages, each holding the
+ * numbers of up to FREELIST_TRUNK_MAX_LEAVES other free pages. Page 0 is
+ * the header and can never be free, so 0 ends the chain.
+ */
+#define FREELIST_NEXT_TRUNK_OFFSET 0
+#define FREELIST_NUM_LEAVES_OFFSET (FREELIST_NEXT_TRUNK_OFFSET + sizeof(uint32_t))
+#define FREELIST_TRUNK_HEADER_SIZE (FREELIST_NUM_LEAVES_OFFSET + sizeof(uint32_t))
+#define FREELIST_TRUNK_MAX_LEAVES \
+    ((PAGE_SIZE - FREELIST_TRUNK_HEADER_SIZE) / sizeof(uint32_t))
 
 NodeType get_node_type(void* node) {
   uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
@@ -171,7 +845,9 @@ void set_node_root(void* node, bool is_root) {
   *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
 }
 
-uint32_t* node_parent(void* node) { return node + PARENT_POINTER_OFFSET; }
+uint32_t* node_right_link(void* node) { return node + NODE_RIGHT_LINK_OFFSET; }
+
+uint32_t* node_high_key(void* node) { return node + NODE_HIGH_KEY_OFFSET; }
 
 uint32_t* internal_node_num_keys(void* node) {
   return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
@@ -185,8 +861,12 @@ uint32_t* internal_node_right_child(void* node) {
   return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+uint32_t* internal_node_keys(void* node) {
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+uint32_t* internal_node_children(void* node) {
+  return node + INTERNAL_NODE_CHILDREN_OFFSET;
 }
 
 uint32_t* internal_node_child(void* node, uint32_t child_num) {
@@ -202,7 +882,7 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
     }
     return right_child;
   } else {
-    uint32_t* child = internal_node_cell(node, child_num);
+    uint32_t* child = internal_node_children(node) + child_num;
     if (*child == INVALID_PAGE_NUM) {
       printf("Tried to access child %d of node, but was invalid page\n", child_num);
       exit(EXIT_FAILURE);
@@ -212,814 +892,6173 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
 }
 
 uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+  return internal_node_keys(node) + key_num;
 }
 
 uint32_t* leaf_node_num_cells(void* node) {
   return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
-uint32_t* leaf_node_next_leaf(void* node) {
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+uint32_t* leaf_node_next_leaf(void* node) { return node_right_link(node); }
+
+uint32_t* leaf_node_content_start(void* node) {
+  return node + LEAF_NODE_CONTENT_START_OFFSET;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint32_t* leaf_node_keys(void* node) {
+  return node + LEAF_NODE_HEADER_SIZE;
 }
 
 uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+  return leaf_node_keys(node) + cell_num;
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+/* The offsets follow the keys, so they move whenever a cell is added */
+uint32_t* leaf_node_offset(void* node, uint32_t cell_num) {
+  return leaf_node_keys(node) + *leaf_node_num_cells(node) + cell_num;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
-  }
-
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+void* leaf_node_value(void* node, uint32_t cell_num) {
+  return node + *leaf_node_offset(node, cell_num);
+}
 
-    // We might save a partial page at the end of the file
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+uint32_t* leaf_node_dictionary_offset(void* node) {
+  return node + LEAF_NODE_DICTIONARY_OFFSET;
+}
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
-    }
+/* NULL for an uncompressed leaf */
+void* leaf_node_dictionary(void* node) {
+  uint32_t offset = *leaf_node_dictionary_offset(node);
+  return offset == 0 ? NULL : node + offset;
+}
 
-    pager->pages[page_num] = page;
+uint8_t* dictionary_entry(void* dictionary, uint8_t index) {
+  uint16_t* offsets = dictionary + LEAF_DICTIONARY_COUNT_SIZE;
+  return dictionary + offsets[index];
+}
 
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
-    }
-  }
+uint32_t leaf_node_free_space(void* node) {
+  return *leaf_node_content_start(node) - LEAF_NODE_HEADER_SIZE -
+         *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+}
 
-  return pager->pages[page_num];
+/*
+Open a slot for `key` at `cell_num` and reserve `size` bytes of record
+space for it. The caller has checked that it fits and writes the record
+into the returned space.
+*/
+void* leaf_node_make_room(void* node, uint32_t cell_num, uint32_t key,
+                          uint32_t size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t* keys = leaf_node_keys(node);
+  uint32_t* offsets = keys + num_cells;
+  /*
+  Offsets after the new cell move two places (one for the new key, one for
+  the new offset), the ones before it one place, then the keys after it
+  one place. Each move only overwrites what an earlier one moved away.
+  */
+  memmove(offsets + cell_num + 2, offsets + cell_num,
+          (num_cells - cell_num) * LEAF_NODE_OFFSET_SIZE);
+  memmove(offsets + 1, offsets, cell_num * LEAF_NODE_OFFSET_SIZE);
+  memmove(keys + cell_num + 1, keys + cell_num,
+          (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+  *leaf_node_num_cells(node) = num_cells + 1;
+  *leaf_node_content_start(node) -= size;
+  *leaf_node_key(node, cell_num) = key;
+  *leaf_node_offset(node, cell_num) = *leaf_node_content_start(node);
+  return leaf_node_value(node, cell_num);
 }
 
-uint32_t get_node_max_key(Pager* pager, void* node) {
-  if (get_node_type(node) == NODE_LEAF) {
-    return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-  }
-  void* right_child = get_page(pager,*internal_node_right_child(node));
-  return get_node_max_key(pager, right_child);
+uint32_t* db_header_field(void* header, uint32_t offset) {
+  return header + offset;
 }
 
-void print_constants() {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+uint32_t* catalog_num_tables(void* catalog) {
+  return catalog + CATALOG_NUM_TABLES_OFFSET;
 }
 
-void indent(uint32_t level) {
-  for (uint32_t i = 0; i < level; i++) {
-    printf("  ");
-  }
+void* catalog_entry(void* catalog, uint32_t slot) {
+  return catalog + CATALOG_HEADER_SIZE + slot * CATALOG_ENTRY_SIZE;
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-  void* node = get_page(pager, page_num);
-  uint32_t num_keys, child;
+char* catalog_entry_name(void* entry) {
+  return entry + CATALOG_NAME_OFFSET;
+}
 
-  switch (get_node_type(node)) {
-    case (NODE_LEAF):
-      num_keys = *leaf_node_num_cells(node);
-      indent(indentation_level);
-      printf("- leaf (size %d)\n", num_keys);
-      for (uint32_t i = 0; i < num_keys; i++) {
-        indent(indentation_level + 1);
-        printf("- %d\n", *leaf_node_key(node, i));
-      }
-      break;
-    case (NODE_INTERNAL):
-      num_keys = *internal_node_num_keys(node);
-      indent(indentation_level);
-      printf("- internal (size %d)\n", num_keys);
-      if (num_keys > 0) {
-        for (uint32_t i = 0; i < num_keys; i++) {
-          child = *internal_node_child(node, i);
-          print_tree(pager, child, indentation_level + 1);
+uint32_t* catalog_entry_root(void* entry) {
+  return entry + CATALOG_ROOT_OFFSET;
+}
 
-          indent(indentation_level + 1);
-          printf("- key %d\n", *internal_node_key(node, i));
-        }
-        child = *internal_node_right_child(node);
-        print_tree(pager, child, indentation_level + 1);
-      }
-      break;
-  }
+uint32_t* catalog_entry_index_root(void* entry, Column column) {
+  return entry + CATALOG_INDEX_ROOTS_OFFSET + column * sizeof(uint32_t);
 }
 
-void serialize_row(Row* source, void* destination) {
-  memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-  memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-  memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+uint32_t* catalog_entry_num_columns(void* entry) {
+  return entry + CATALOG_NUM_COLUMNS_OFFSET;
 }
 
-void deserialize_row(void* source, Row* destination) {
-  memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-  memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+/* The column's type, followed by its size */
+uint16_t* catalog_entry_column(void* entry, Column column) {
+  return entry + CATALOG_COLUMNS_OFFSET + column * CATALOG_COLUMN_SIZE;
 }
 
-void initialize_leaf_node(void* node) {
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);
-  *leaf_node_num_cells(node) = 0;
-  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+uint32_t* index_node_count(void* node) {
+  return node + INDEX_NODE_COUNT_OFFSET;
 }
 
-void initialize_internal_node(void* node) {
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
-  /*
-  Necessary because the root page number is 0; by not initializing an internal 
-  node's right child to an invalid page number when initializing the node, we may
-  end up with 0 as the node's right child, which makes the node a parent of the root
-  */
-  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+uint32_t* index_node_link(void* node) {
+  return node + INDEX_NODE_LINK_OFFSET;
 }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+uint64_t* index_node_entries(void* node) {
+  return node + INDEX_NODE_HEADER_SIZE;
+}
 
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
-  cursor->end_of_table = false;
+uint32_t* index_node_children(void* node) {
+  return node + INDEX_INTERNAL_CHILDREN_OFFSET;
+}
 
-  // Binary search
-  uint32_t min_index = 0;
-  uint32_t one_past_max_index = num_cells;
-  while (one_past_max_index != min_index) {
-    uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
-    if (key == key_at_index) {
-      cursor->cell_num = index;
-      return cursor;
-    }
-    if (key < key_at_index) {
-      one_past_max_index = index;
-    } else {
-      min_index = index + 1;
-    }
-  }
+/* Child `child_num` of an index internal node, the link past the last */
+uint32_t index_node_child(void* node, uint32_t child_num) {
+  return child_num == *index_node_count(node) ? *index_node_link(node)
+                                              : index_node_children(node)[child_num];
+}
 
-  cursor->cell_num = min_index;
-  return cursor;
+uint32_t* freelist_next_trunk(void* trunk) {
+  return trunk + FREELIST_NEXT_TRUNK_OFFSET;
 }
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-  /*
-  Return the index of the child which should contain
-  the given key.
-  */
+uint32_t* freelist_num_leaves(void* trunk) {
+  return trunk + FREELIST_NUM_LEAVES_OFFSET;
+}
 
-  uint32_t num_keys = *internal_node_num_keys(node);
+uint32_t* freelist_leaf(void* trunk, uint32_t leaf_num) {
+  return trunk + FREELIST_TRUNK_HEADER_SIZE + leaf_num * sizeof(uint32_t);
+}
 
-  /* Binary search */
-  uint32_t min_index = 0;
-  uint32_t max_index = num_keys; /* there is one more child than key */
+uint32_t page_table_slot(Pager* pager, uint32_t page_num) {
+  /* Fibonacci hashing spreads consecutive page numbers across the table */
+  return (page_num * 2654435769u) & (pager->page_table_capacity - 1);
+}
 
-  while (min_index != max_index) {
-    uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
-    if (key_to_right >= key) {
-      max_index = index;
-    } else {
-      min_index = index + 1;
+uint32_t page_table_lookup(Pager* pager, uint32_t page_num) {
+  uint32_t mask = pager->page_table_capacity - 1;
+  uint32_t slot = page_table_slot(pager, page_num);
+  while (pager->page_table[slot] != INVALID_FRAME) {
+    uint32_t frame_index = pager->page_table[slot];
+    if (pager->frames[frame_index].page_num == page_num) {
+      return frame_index;
     }
+    slot = (slot + 1) & mask;
   }
-
-  return min_index;
+  return INVALID_FRAME;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-  void* child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+void page_table_insert(Pager* pager, uint32_t page_num, uint32_t frame_index) {
+  uint32_t mask = pager->page_table_capacity - 1;
+  uint32_t slot = page_table_slot(pager, page_num);
+  while (pager->page_table[slot] != INVALID_FRAME) {
+    slot = (slot + 1) & mask;
   }
+  pager->page_table[slot] = frame_index;
 }
 
-/*
-Return the position of the given key.
-If the key is not present, return the position
-where it should be inserted
-*/
-Cursor* table_find(Table* table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
+void page_table_remove(Pager* pager, uint32_t page_num) {
+  uint32_t mask = pager->page_table_capacity - 1;
+  uint32_t hole = page_table_slot(pager, page_num);
+  while (pager->frames[pager->page_table[hole]].page_num != page_num) {
+    hole = (hole + 1) & mask;
+  }
+  pager->page_table[hole] = INVALID_FRAME;
 
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
-  } else {
-    return internal_node_find(table, root_page_num, key);
+  /*
+  Linear probing has no tombstones: shift later entries of the same probe
+  run back into the hole so lookups never stop early
+  */
+  uint32_t slot = hole;
+  while (true) {
+    slot = (slot + 1) & mask;
+    uint32_t frame_index = pager->page_table[slot];
+    if (frame_index == INVALID_FRAME) {
+      return;
+    }
+    uint32_t home = page_table_slot(pager, pager->frames[frame_index].page_num);
+    bool home_between = (hole <= slot) ? (hole < home && home <= slot)
+                                       : (hole < home || home <= slot);
+    if (!home_between) {
+      pager->page_table[hole] = frame_index;
+      pager->page_table[slot] = INVALID_FRAME;
+      hole = slot;
+    }
   }
 }
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = table_find(table, 0);
+bool page_size_valid(uint32_t size) {
+  return size >= MIN_PAGE_SIZE && size <= MAX_PAGE_SIZE && (size & (size - 1)) == 0;
+}
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+off_t wal_frame_offset(uint32_t frame) {
+  return sizeof(WalHeader) + (off_t)frame * WAL_FRAME_SIZE;
+}
 
-  return cursor;
+uint32_t wal_checksum(uint32_t salt, uint32_t page_num, uint32_t db_size,
+                      void* data) {
+  /* Fletcher-style running sums over 32-bit words */
+  uint32_t s0 = salt + page_num;
+  uint32_t s1 = salt + db_size;
+  uint32_t* words = data;
+  for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i += 2) {
+    s0 += words[i] + s1;
+    s1 += words[i + 1] + s0;
+  }
+  return s1;
 }
 
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+/*
+Write `count` buffers laid out back to back at `offset` with one pwritev
+*/
+void pwritev_all(int fd, struct iovec* iov, int count, off_t offset) {
+  ssize_t expected = 0;
+  for (int i = 0; i < count; i++) {
+    expected += iov[i].iov_len;
+  }
+  if (pwritev(fd, iov, count, offset) != expected) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 }
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
+/*
+Append one LZ sequence: `num_literals` bytes copied as is, then a match of
+`match_length` bytes `offset` back (none for the final sequence, which is
+literals only). Returns the new output size, 0 if it would not fit.
+*/
+uint32_t lz_emit(uint8_t* destination, uint32_t capacity, uint32_t out,
+                 const uint8_t* literals, uint32_t num_literals,
+                 uint32_t offset, uint32_t match_length) {
+  uint32_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+  if (out + 1 + num_literals / 255 + 1 + num_literals + 2 + match_code / 255 + 1 >
+      capacity) {
+    return 0;
+  }
+  uint8_t* token = destination + out++;
+  *token = (num_literals < 15 ? num_literals : 15) << 4 |
+           (match_code < 15 ? match_code : 15);
+  if (num_literals >= 15) {
+    uint32_t rest = num_literals - 15;
+    for (; rest >= 255; rest -= 255) {
+      destination[out++] = 255;
+    }
+    destination[out++] = rest;
+  }
+  memcpy(destination + out, literals, num_literals);
+  out += num_literals;
+  if (match_length == 0) {
+    return out;
+  }
+  destination[out++] = offset & 0xff;
+  destination[out++] = offset >> 8;
+  if (match_code >= 15) {
+    uint32_t rest = match_code - 15;
+    for (; rest >= 255; rest -= 255) {
+      destination[out++] = 255;
+    }
+    destination[out++] = rest;
+  }
+  return out;
+}
 
-  cursor->cell_num += 1;
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    /* Advance to next leaf node */
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      /* This was rightmost leaf */
-      cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+/*
+Compress with greedy LZ77 in the LZ4 block layout: a token byte holds the
+literal count and match length (15 meaning more length bytes follow), then
+the literals, then a two byte match offset. Matches are found through a
+hash of the next four bytes. Returns the compressed size, or 0 if it does
+not fit in `capacity`.
+*/
+uint32_t lz_compress(const uint8_t* source, uint32_t length,
+                     uint8_t* destination, uint32_t capacity) {
+  uint32_t table[1 << LZ_HASH_BITS];  // last position + 1 of each hash
+  memset(table, 0, sizeof(table));
+  uint32_t in = 0, anchor = 0, out = 0;
+  while (in + LZ_MIN_MATCH <= length) {
+    uint32_t sequence;
+    memcpy(&sequence, source + in, sizeof(sequence));
+    uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    uint32_t candidate = table[hash];
+    table[hash] = in + 1;
+    if (candidate == 0 || in - (candidate - 1) > 0xffff ||
+        memcmp(source + candidate - 1, source + in, LZ_MIN_MATCH) != 0) {
+      in++;
+      continue;
+    }
+    candidate--;
+    uint32_t match_length = LZ_MIN_MATCH;
+    while (in + match_length < length &&
+           source[candidate + match_length] == source[in + match_length]) {
+      match_length++;
     }
+    out = lz_emit(destination, capacity, out, source + anchor, in - anchor,
+                  in - candidate, match_length);
+    if (out == 0) {
+      return 0;
+    }
+    in += match_length;
+    anchor = in;
   }
+  return lz_emit(destination, capacity, out, source + anchor, length - anchor, 0, 0);
 }
 
-Pager* pager_open(const char* filename) {
-  //fd is a file descriptor, an integer that refers to the open file
-  // if the open() function returns -1 it means that the opening operation has failed
-  int fd = open(filename,
-                O_RDWR |      // Read/Write mode
-                    O_CREAT,  // Create file if it does not exist
-                S_IWUSR |     // User write permission
-                    S_IRUSR   // User read permission
-                );
+/*
+Returns false unless `source` decodes to exactly `length` bytes
+*/
+bool lz_decompress(const uint8_t* source, uint32_t source_length,
+                   uint8_t* destination, uint32_t length) {
+  uint32_t in = 0, out = 0;
+  while (in < source_length) {
+    uint8_t token = source[in++];
+    uint32_t num_literals = token >> 4;
+    if (num_literals == 15) {
+      uint8_t more;
+      do {
+        if (in == source_length) {
+          return false;
+        }
+        more = source[in++];
+        num_literals += more;
+      } while (more == 255);
+    }
+    if (num_literals > source_length - in || num_literals > length - out) {
+      return false;
+    }
+    memcpy(destination + out, source + in, num_literals);
+    in += num_literals;
+    out += num_literals;
+    if (in == source_length) {
+      break;  // the final sequence has no match
+    }
 
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+    if (source_length - in < 2) {
+      return false;
+    }
+    uint32_t offset = source[in] | source[in + 1] << 8;
+    in += 2;
+    uint32_t match_length = token & 15;
+    if (match_length == 15) {
+      uint8_t more;
+      do {
+        if (in == source_length) {
+          return false;
+        }
+        more = source[in++];
+        match_length += more;
+      } while (more == 255);
+    }
+    match_length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out || match_length > length - out) {
+      return false;
+    }
+    if (offset >= match_length) {
+      memcpy(destination + out, destination + out - offset, match_length);
+    } else {
+      // Byte by byte: the match overlaps the bytes it produces
+      for (uint32_t i = 0; i < match_length; i++) {
+        destination[out + i] = destination[out - offset + i];
+      }
+    }
+    out += match_length;
   }
-  // the lseek() function moves the file offset to the end and returns the length of the file in bytes
-  off_t file_length = lseek(fd, 0, SEEK_END);
+  return out == length;
+}
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
+/*
+Write `count` consecutive pages starting at `first_page` to the main file.
+Plain pages go out in one pwritev. With page compression (and pages bigger
+than a file block) each page is stored compressed when that frees at least
+one block, and the unused tail of its slot is punched out. Returns the number of pages stored
+compressed.
+*/
+uint32_t pager_write_pages(Pager* pager, uint32_t first_page, struct iovec* iov,
+                           int count) {
+  int fd = pager->file_descriptor;
+  if (!pager->compress_pages || PAGE_SIZE <= FILE_BLOCK_SIZE) {
+    pwritev_all(fd, iov, count, (off_t)first_page * PAGE_SIZE);
+    return 0;
+  }
 
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file.\n");
+  /* Slots past the end of the file must exist before their tails are holes */
+  off_t end = (off_t)(first_page + count) * PAGE_SIZE;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 ||
+      (file_stat.st_size < end && ftruncate(fd, end) == -1)) {
+    printf("Error writing: %d\n", errno);
     exit(EXIT_FAILURE);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
-  }
+  uint32_t num_compressed = 0;
+  uint8_t* buffer = malloc(PAGE_SIZE);
+  for (int i = 0; i < count; i++) {
+    uint32_t page_num = first_page + i;
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    uint32_t size = 0;
+    if (page_num != 0) {  // the header is read before we know the page size
+      size = lz_compress(iov[i].iov_base, PAGE_SIZE,
+                         buffer + PAGE_COMPRESSED_HEADER_SIZE,
+                         PAGE_SIZE - PAGE_COMPRESSED_HEADER_SIZE - FILE_BLOCK_SIZE);
+    }
+    if (size == 0) {
+      pwritev_all(fd, &iov[i], 1, offset);
+      continue;
+    }
 
-  return pager;
+    uint32_t* header = (uint32_t*)buffer;
+    header[0] = PAGE_COMPRESSED_MAGIC;
+    header[1] = size;
+    size += PAGE_COMPRESSED_HEADER_SIZE;
+    uint32_t stored = (size + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE * FILE_BLOCK_SIZE;
+    memset(buffer + size, 0, stored - size);
+    if (pwrite(fd, buffer, stored, offset) != stored) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    /* A file system without holes just keeps the zeroed tail */
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset + stored,
+                  PAGE_SIZE - stored) == -1 &&
+        errno != EOPNOTSUPP) {
+      printf("Error punching hole: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    num_compressed++;
+  }
+  free(buffer);
+  return num_compressed;
 }
 
-Table* db_open(const char* filename) {
-  Pager* pager = pager_open(filename);
-
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
-  table->root_page_num = 0;
-
-  if (pager->num_pages == 0) {
-    // New database file. Initialize page 0 as leaf node.
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
+/*
+Turn a slot read from the main file back into a plain page
+*/
+void page_decompress(void* page, uint32_t page_num) {
+  uint32_t* header = page;
+  if (header[0] != PAGE_COMPRESSED_MAGIC) {
+    return;
   }
-
-  return table;
+  uint32_t size = header[1];
+  if (size > PAGE_SIZE - PAGE_COMPRESSED_HEADER_SIZE) {
+    printf("Corrupt compressed page %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  uint8_t* compressed = malloc(size);
+  memcpy(compressed, page + PAGE_COMPRESSED_HEADER_SIZE, size);
+  if (!lz_decompress(compressed, size, page, PAGE_SIZE)) {
+    printf("Corrupt compressed page %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  free(compressed);
 }
 
-InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+void wal_track_frame(Wal* wal, uint32_t page_num) {
+  if (wal->num_frames == wal->frame_capacity) {
+    wal->frame_capacity = wal->frame_capacity ? wal->frame_capacity * 2 : 256;
+    wal->frame_pages =
+        realloc(wal->frame_pages, sizeof(uint32_t) * wal->frame_capacity);
+  }
+  if (page_num >= wal->page_capacity) {
+    uint32_t new_capacity = wal->page_capacity ? wal->page_capacity : 256;
+    while (new_capacity <= page_num) {
+      new_capacity *= 2;
+    }
+    wal->page_frames = realloc(wal->page_frames, sizeof(uint32_t) * new_capacity);
+    memset(wal->page_frames + wal->page_capacity, 0,
+           sizeof(uint32_t) * (new_capacity - wal->page_capacity));
+    wal->page_capacity = new_capacity;
+  }
 
-  return input_buffer;
+  wal->frame_pages[wal->num_frames] = page_num;
+  wal->page_frames[page_num] = wal->num_frames + 1;
+  wal->num_frames++;
+  wal->frames_written++;
 }
 
-void print_prompt() { printf("db > "); }
+/*
+Append page images to the log, WRITE_BATCH_PAGES frames per pwritev. Only
+the last frame carries `db_size`, so a nonzero value makes the batch a
+commit. Caller holds wal->lock.
+*/
+void wal_append_frames(Wal* wal, uint32_t count, uint32_t* page_nums, void** pages,
+                       uint32_t db_size) {
+  WalFrameHeader headers[WRITE_BATCH_PAGES];
+  struct iovec iov[2 * WRITE_BATCH_PAGES];
+
+  for (uint32_t start = 0; start < count; start += WRITE_BATCH_PAGES) {
+    uint32_t batch = count - start;
+    if (batch > WRITE_BATCH_PAGES) {
+      batch = WRITE_BATCH_PAGES;
+    }
+    off_t offset = wal_frame_offset(wal->num_frames);
+    for (uint32_t i = 0; i < batch; i++) {
+      uint32_t page_num = page_nums[start + i];
+      WalFrameHeader* header = &headers[i];
+      header->page_num = page_num;
+      header->db_size = (start + i == count - 1) ? db_size : 0;
+      header->salt = wal->salt;
+      header->checksum =
+          wal_checksum(wal->salt, page_num, header->db_size, pages[start + i]);
+      iov[2 * i].iov_base = header;
+      iov[2 * i].iov_len = sizeof(WalFrameHeader);
+      iov[2 * i + 1].iov_base = pages[start + i];
+      iov[2 * i + 1].iov_len = PAGE_SIZE;
+      wal_track_frame(wal, page_num);
+    }
+    pwritev_all(wal->file_descriptor, iov, 2 * batch, offset);
+  }
+}
 
-void read_input(InputBuffer* input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+/*
+Read a page for the buffer pool: its latest WAL image if it has one,
+otherwise the main file. Only the lookup is done under the WAL lock, so
+parallel scan workers and snapshot readers miss concurrently. A frame
+stays put until the log is reset, which bumps the generation; a read
+that raced a reset may have seen a reused frame and is done again, this
+time from the main file the checkpoint copied the page into.
+*/
+void pager_read_page(Pager* pager, uint32_t page_num, void* destination) {
+  Wal* wal = pager->wal;
+  while (true) {
+    int fd = -1;
+    off_t offset = 0;
+    uint64_t generation = 0;
+    if (wal) {
+      pthread_mutex_lock(&wal->lock);
+      generation = wal->generation;
+    }
+    if (wal && page_num < wal->page_capacity && wal->page_frames[page_num]) {
+      fd = wal->file_descriptor;
+      offset = wal_frame_offset(wal->page_frames[page_num] - 1) + sizeof(WalFrameHeader);
+    } else if (page_num < __atomic_load_n(&pager->file_length, __ATOMIC_ACQUIRE) / PAGE_SIZE) {
+      fd = pager->file_descriptor;
+      offset = (off_t)page_num * PAGE_SIZE;
+    }
+    if (wal) {
+      pthread_mutex_unlock(&wal->lock);
+    }
 
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
-    exit(EXIT_FAILURE);
+    // Pages past the end of the file have never been written: start zeroed
+    memset(destination, 0, PAGE_SIZE);
+    if (fd != -1 && pread(fd, destination, PAGE_SIZE, offset) == -1) {
+      printf("Error reading file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    if (fd == pager->file_descriptor) {
+      page_decompress(destination, page_num);
+      return;
+    }
+    if (fd == -1 || __atomic_load_n(&wal->generation, __ATOMIC_ACQUIRE) == generation) {
+      return;
+    }
   }
-
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
 }
 
-void close_input_buffer(InputBuffer* input_buffer) {
-  free(input_buffer->buffer);
-  free(input_buffer);
+/*
+Record that the main file now reaches `length` bytes. Without a WAL,
+parallel scan workers and snapshot readers check file_length with no lock
+held while the writer, the background write-back or a worker evicting a
+dirty page grows it, so it only changes atomically.
+*/
+void pager_extend_file(Pager* pager, off_t length) {
+  off_t current = __atomic_load_n(&pager->file_length, __ATOMIC_RELAXED);
+  while (length > current &&
+         !__atomic_compare_exchange_n(&pager->file_length, &current, length, false,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
 }
 
 void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
+  uint32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index == INVALID_FRAME) {
+    printf("Tried to flush page %d which is not in the buffer pool\n", page_num);
     exit(EXIT_FAILURE);
   }
+  Frame* frame = &pager->frames[frame_index];
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+  if (pager->wal) {
+    /*
+    With a WAL the main file only ever receives committed pages, so a dirty
+    page evicted mid-group is spilled to the log as an uncommitted frame
+    */
+    pthread_mutex_lock(&pager->wal->lock);
+    wal_append_frames(pager->wal, 1, &page_num, &frame->data, 0);
+    pthread_mutex_unlock(&pager->wal->lock);
+    frame->dirty = false;
+    return;
   }
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+  struct iovec iov = {frame->data, PAGE_SIZE};
+  pager->pages_compressed += pager_write_pages(pager, page_num, &iov, 1);
 
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
+  frame->dirty = false;
+  pager_extend_file(pager, (off_t)(page_num + 1) * PAGE_SIZE);
 }
 
-void db_close(Table* table) {
-  Pager* pager = table->pager;
-
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
+/*
+Find a frame for a page that is not cached, evicting with the CLOCK
+algorithm: the hand sweeps the frames, skipping pinned ones and giving
+recently referenced ones a second chance. Dirty victims are written back
+before the frame is reused.
+*/
+uint32_t pager_claim_frame(Pager* pager) {
+  for (uint32_t i = 0; i < 2 * pager->num_frames; i++) {
+    uint32_t frame_index = pager->clock_hand;
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+    Frame* frame = &pager->frames[frame_index];
+
+    if (frame->page_num == INVALID_PAGE_NUM) {
+      return frame_index;
+    }
+    if (frame->pin_count > 0 || frame->readers > 0) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
       continue;
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+
+    if (frame->dirty) {
+      pager_flush(pager, frame->page_num);
+    }
+    page_table_remove(pager, frame->page_num);
+    frame->page_num = INVALID_PAGE_NUM;
+    pager->evictions++;
+    return frame_index;
   }
 
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+  printf("Buffer pool exhausted: all %d frames are pinned\n", pager->num_frames);
+  exit(EXIT_FAILURE);
+}
+
+/*
+Pages of an mmap pager live in the mapping itself, so a page pointer is
+just an offset into it. Reaching past the end of the file grows the file.
+*/
+void* mmap_get_page(Pager* pager, uint32_t page_num) {
+  off_t needed = (off_t)(page_num + 1) * PAGE_SIZE;
+
+  if (needed > pager->file_length) {
+    off_t chunk = (off_t)MMAP_GROW_PAGES * PAGE_SIZE;
+    off_t new_length = (needed + chunk - 1) / chunk * chunk;
+    if (ftruncate(pager->file_descriptor, new_length) == -1) {
+      printf("Error growing file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = new_length;
   }
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+
+  if ((size_t)needed > pager->map_length) {
+    size_t new_map_length = pager->map_length;
+    while (new_map_length < (size_t)needed) {
+      new_map_length *= 2;
+    }
+    /*
+    Only grow in place: moving the mapping would leave the page pointers
+    the caller is holding dangling
+    */
+    void* map = mremap(pager->map, pager->map_length, new_map_length, 0);
+    if (map == MAP_FAILED) {
+      printf("Unable to grow file mapping: %d\n", errno);
+      exit(EXIT_FAILURE);
     }
+    pager->map_length = new_map_length;
   }
-  free(pager);
-  free(table);
-}
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    close_input_buffer(input_buffer);
-    db_close(table);
-    exit(EXIT_SUCCESS);
-  } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
-    return META_COMMAND_SUCCESS;
-  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
-    return META_COMMAND_SUCCESS;
-  } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
   }
-}
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
+  return pager->map + (size_t)page_num * PAGE_SIZE;
+}
 
-  char* keyword = strtok(input_buffer->buffer, " ");
-  char* id_string = strtok(NULL, " ");
-  char* username = strtok(NULL, " ");
-  char* email = strtok(NULL, " ");
+__thread Snapshot* thread_snapshot = NULL;  // the snapshot this thread reads from
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+/*
+The version of the page a snapshot at `epoch` reads: the oldest one taken
+after it, since that holds the page as it was before anything later
+changed it. NULL when the page has not changed since. Caller holds
+pool_lock.
+*/
+PageVersion* pager_find_version(Pager* pager, uint32_t page_num, uint64_t epoch) {
+  PageVersion* found = NULL;
+  for (PageVersion* version = pager->versions[page_num % VERSION_BUCKETS];
+       version != NULL; version = version->next) {
+    if (version->page_num == page_num && version->epoch > epoch &&
+        (found == NULL || version->epoch < found->epoch)) {
+      found = version;
+    }
   }
+  return found;
+}
 
-  int id = atoi(id_string);
-  if (id < 0) {
-    return PREPARE_NEGATIVE_ID;
+/*
+Called by the writer's get_page while snapshots are open, before the page
+can be changed. The first touch of the page in a statement copies it,
+unless every open snapshot already reads an earlier version. Then waits
+for the readers still on the frame to let go of it. Caller holds pool_lock.
+*/
+void pager_preserve_page(Pager* pager, Frame* frame) {
+  uint64_t epoch = pager->epoch + 1;  // of the running statement
+  uint64_t newest = 0;
+  for (PageVersion* version = pager->versions[frame->page_num % VERSION_BUCKETS];
+       version != NULL; version = version->next) {
+    if (version->page_num == frame->page_num && version->epoch > newest) {
+      newest = version->epoch;
+    }
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  uint64_t latest_snapshot = 0;
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshot_epochs[i] > latest_snapshot) {
+      latest_snapshot = pager->snapshot_epochs[i];
+    }
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+
+  if (newest != epoch && latest_snapshot >= newest) {
+    PageVersion* version = malloc(sizeof(PageVersion));
+    version->page_num = frame->page_num;
+    version->epoch = epoch;
+    version->data = malloc(PAGE_SIZE);
+    memcpy(version->data, frame->data, PAGE_SIZE);
+    version->next = pager->versions[frame->page_num % VERSION_BUCKETS];
+    pager->versions[frame->page_num % VERSION_BUCKETS] = version;
+    pager->num_versions++;
+  }
+  while (frame->readers > 0) {
+    pthread_cond_wait(&pager->page_released, &pager->pool_lock);
   }
+}
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+/*
+get_page for a snapshot reader. A version taken after the snapshot wins;
+otherwise the page has not changed since, and a cached frame is held
+rather than pinned, so the writer's pins are left alone. A miss is read
+into a private copy without touching the pool, and is dropped for a
+version if the writer took one of the page meanwhile.
+*/
+void* snapshot_get_page(Pager* pager, Snapshot* snapshot, uint32_t page_num) {
+  HeldPage held = {page_num, INVALID_FRAME, NULL};
+  void* data;
+
+  pthread_mutex_lock(&pager->pool_lock);
+  PageVersion* version = pager_find_version(pager, page_num, snapshot->epoch);
+  if (version != NULL) {
+    data = version->data;
+  } else if ((held.frame_index = page_table_lookup(pager, page_num)) != INVALID_FRAME) {
+    pager->hits++;
+    Frame* frame = &pager->frames[held.frame_index];
+    frame->readers++;
+    frame->referenced = true;
+    while (frame->loading) {
+      pthread_cond_wait(&pager->page_loaded, &pager->pool_lock);
+    }
+    data = frame->data;
+  } else {
+    pager->misses++;
+    pthread_mutex_unlock(&pager->pool_lock);
+    held.copy = malloc(PAGE_SIZE);
+    pager_read_page(pager, page_num, held.copy);
+    pthread_mutex_lock(&pager->pool_lock);
+
+    version = pager_find_version(pager, page_num, snapshot->epoch);
+    if (version != NULL) {
+      free(held.copy);
+      held.copy = NULL;
+      data = version->data;
+    } else {
+      data = held.copy;
+    }
+  }
+  pthread_mutex_unlock(&pager->pool_lock);
 
-  return PREPARE_SUCCESS;
+  if (snapshot->num_held == snapshot->held_capacity) {
+    snapshot->held_capacity = snapshot->held_capacity ? 2 * snapshot->held_capacity : 16;
+    snapshot->held = realloc(snapshot->held, sizeof(HeldPage) * snapshot->held_capacity);
+  }
+  snapshot->held[snapshot->num_held++] = held;
+  return data;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer,
-                                Statement* statement) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement);
+void snapshot_release(Pager* pager, HeldPage* held) {
+  if (held->frame_index != INVALID_FRAME) {
+    pthread_mutex_lock(&pager->pool_lock);
+    if (--pager->frames[held->frame_index].readers == 0) {
+      pthread_cond_broadcast(&pager->page_released);
+    }
+    pthread_mutex_unlock(&pager->pool_lock);
   }
-  if (strcmp(input_buffer->buffer, "select") == 0) {
-    statement->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  free(held->copy);
+}
+
+/* pager_unpin for a snapshot reader: lets go of its latest hold on the page */
+void snapshot_unpin(Pager* pager, Snapshot* snapshot, uint32_t page_num) {
+  for (uint32_t i = snapshot->num_held; i > 0; i--) {
+    if (snapshot->held[i - 1].page_num == page_num) {
+      snapshot_release(pager, &snapshot->held[i - 1]);
+      snapshot->held[i - 1] = snapshot->held[--snapshot->num_held];
+      return;
+    }
   }
+}
 
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+/*
+Open a snapshot of the database as of the last statement. Caller holds
+pager->lock, so no statement is half done, and copies whatever Table
+fields it needs before letting go of it.
+*/
+void pager_begin_snapshot(Pager* pager, Snapshot* snapshot) {
+  snapshot->held = NULL;
+  snapshot->num_held = 0;
+  snapshot->held_capacity = 0;
+
+  pthread_mutex_lock(&pager->pool_lock);
+  snapshot->epoch = pager->epoch;
+  if (pager->num_snapshots == pager->snapshot_capacity) {
+    pager->snapshot_capacity = pager->snapshot_capacity ? 2 * pager->snapshot_capacity : 8;
+    pager->snapshot_epochs = realloc(pager->snapshot_epochs,
+                                     sizeof(uint64_t) * pager->snapshot_capacity);
+  }
+  pager->snapshot_epochs[pager->num_snapshots++] = snapshot->epoch;
+  pthread_mutex_unlock(&pager->pool_lock);
 }
 
 /*
-Until we start recycling free pages, new pages will always
-go onto the end of the database file
+Release what the snapshot still holds and close it. Versions no open
+snapshot can read any more are freed: those at or before the oldest
+snapshot left, which reads a later version or the frame instead.
 */
-uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
+void pager_end_snapshot(Pager* pager, Snapshot* snapshot) {
+  for (uint32_t i = 0; i < snapshot->num_held; i++) {
+    snapshot_release(pager, &snapshot->held[i]);
+  }
+  free(snapshot->held);
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  /*
-  Handle splitting the root.
-  Old root copied to new page, becomes left child.
-  Address of right child passed in.
-  Re-initialize root page to contain the new root node.
-  New root node points to two children.
-  */
+  pthread_mutex_lock(&pager->pool_lock);
+  uint32_t slot = 0;
+  while (pager->snapshot_epochs[slot] != snapshot->epoch) {
+    slot++;
+  }
+  pager->snapshot_epochs[slot] = pager->snapshot_epochs[pager->num_snapshots - 1];
+  __atomic_store_n(&pager->num_snapshots, pager->num_snapshots - 1, __ATOMIC_RELEASE);
+  uint64_t oldest = UINT64_MAX;
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshot_epochs[i] < oldest) {
+      oldest = pager->snapshot_epochs[i];
+    }
+  }
+
+  for (uint32_t bucket = 0; pager->num_versions > 0 && bucket < VERSION_BUCKETS;
+       bucket++) {
+    PageVersion** link = &pager->versions[bucket];
+    while (*link != NULL) {
+      PageVersion* version = *link;
+      if (version->epoch <= oldest) {
+        *link = version->next;
+        free(version->data);
+        free(version);
+        pager->num_versions--;
+      } else {
+        link = &version->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&pager->pool_lock);
+}
+
+/*
+get_page for parallel scan workers, and for the writer while snapshots are
+open. A missing page gets its frame pinned and marked loading before
+pool_lock is dropped for the read, so other workers can use the pool
+meanwhile; one that wants the same page waits for page_loaded.
+*/
+void* get_page_shared(Pager* pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->pool_lock);
+  uint32_t frame_index = page_table_lookup(pager, page_num);
+  Frame* frame;
+  if (frame_index == INVALID_FRAME) {
+    pager->misses++;
+    frame_index = pager_claim_frame(pager);
+    frame = &pager->frames[frame_index];
+    frame->page_num = page_num;
+    frame->pin_count = 1;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->loading = true;
+    page_table_insert(pager, page_num, frame_index);
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+    pthread_mutex_unlock(&pager->pool_lock);
+
+    pager_read_page(pager, page_num, frame->data);
+
+    pthread_mutex_lock(&pager->pool_lock);
+    frame->loading = false;
+    pthread_cond_broadcast(&pager->page_loaded);
+  } else {
+    pager->hits++;
+    frame = &pager->frames[frame_index];
+    frame->pin_count++;
+    frame->referenced = true;
+    while (frame->loading) {
+      pthread_cond_wait(&pager->page_loaded, &pager->pool_lock);
+    }
+  }
+  if (pager->num_snapshots > 0 && !pager->shared) {
+    pager_preserve_page(pager, frame);  // a parallel scan only reads
+  }
+  pthread_mutex_unlock(&pager->pool_lock);
+  return frame->data;
+}
+
+/*
+Return the page, loading it into the buffer pool on a miss. The page is
+pinned and stays resident until it is unpinned.
+*/
+void* get_page(Pager* pager, uint32_t page_num) {
+  if (page_num == INVALID_PAGE_NUM) {
+    printf("Tried to fetch invalid page number\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (pager->mode == PAGER_MMAP) {
+    return mmap_get_page(pager, page_num);
+  }
+  if (thread_snapshot != NULL) {
+    return snapshot_get_page(pager, thread_snapshot, page_num);
+  }
+  /*
+  Snapshots only open between statements, so one the writer has not seen
+  here yet can not read anything the statement changes. The acquire pairs
+  with the release in pager_end_snapshot: once none are left, whatever the
+  last one did to the pool is visible here.
+  */
+  if (pager->shared || __atomic_load_n(&pager->num_snapshots, __ATOMIC_ACQUIRE) > 0) {
+    return get_page_shared(pager, page_num);
+  }
+
+  uint32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index == INVALID_FRAME) {
+    // Cache miss. Claim a frame and load from file.
+    pager->misses++;
+    frame_index = pager_claim_frame(pager);
+    Frame* frame = &pager->frames[frame_index];
+    pager_read_page(pager, page_num, frame->data);
+
+    frame->page_num = page_num;
+    frame->pin_count = 0;
+    frame->dirty = false;
+    page_table_insert(pager, page_num, frame_index);
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  } else {
+    pager->hits++;
+  }
+
+  Frame* frame = &pager->frames[frame_index];
+  frame->pin_count++;
+  frame->referenced = true;
+  return frame->data;
+}
+
+void pager_unpin(Pager* pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MMAP) {
+    return;
+  }
+  if (thread_snapshot != NULL) {
+    snapshot_unpin(pager, thread_snapshot, page_num);
+    return;
+  }
+  bool shared =
+      pager->shared || __atomic_load_n(&pager->num_snapshots, __ATOMIC_ACQUIRE) > 0;
+  if (shared) {
+    pthread_mutex_lock(&pager->pool_lock);
+  }
+  uint32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index != INVALID_FRAME && pager->frames[frame_index].pin_count > 0) {
+    pager->frames[frame_index].pin_count--;
+  }
+  if (shared) {
+    pthread_mutex_unlock(&pager->pool_lock);
+  }
+}
+
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+  if (pager->mode == PAGER_MMAP) {
+    return;  // stores go straight to the shared mapping
+  }
+  uint32_t frame_index = page_table_lookup(pager, page_num);
+  if (frame_index == INVALID_FRAME) {
+    printf("Tried to dirty page %d which is not in the buffer pool\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  pager->frames[frame_index].dirty = true;
+}
+
+int compare_uint32(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+int compare_uint64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/*
+Tell the kernel these pages will be read soon, so it can start reading
+them in the background. The pages are sorted first and neighbours go in
+one request, which the kernel reads as a single sequential run.
+*/
+void pager_advise(Pager* pager, uint32_t* pages, uint32_t num_pages) {
+  qsort(pages, num_pages, sizeof(uint32_t), compare_uint32);
+  uint32_t i = 0;
+  while (i < num_pages) {
+    uint32_t run_end = i + 1;
+    while (run_end < num_pages && pages[run_end] - pages[run_end - 1] <= 1) {
+      run_end++;
+    }
+    posix_fadvise(pager->file_descriptor, (off_t)pages[i] * PAGE_SIZE,
+                  (off_t)(pages[run_end - 1] - pages[i] + 1) * PAGE_SIZE,
+                  POSIX_FADV_WILLNEED);
+    i = run_end;
+  }
+}
+
+double elapsed_ms(struct timespec* since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/*
+List the cached pages that differ from disk, in page order. The caller
+frees the array.
+*/
+uint32_t* pager_dirty_pages(Pager* pager, uint32_t* num_dirty) {
+  uint32_t* dirty_pages = malloc(sizeof(uint32_t) * (pager->num_frames + 1));
+  *num_dirty = 0;
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    if (pager->frames[i].page_num != INVALID_PAGE_NUM && pager->frames[i].dirty) {
+      dirty_pages[(*num_dirty)++] = pager->frames[i].page_num;
+    }
+  }
+  qsort(dirty_pages, *num_dirty, sizeof(uint32_t), compare_uint32);
+  return dirty_pages;
+}
+
+void pager_wake_background(Pager* pager) {
+  pthread_mutex_lock(&pager->background_lock);
+  pthread_cond_signal(&pager->background_wake);
+  pthread_mutex_unlock(&pager->background_lock);
+}
+
+/*
+Write every dirty page back to the main file when there is no WAL. Pages
+are sorted, so each run of consecutive page numbers leaves in a single
+pwritev instead of one write per page. Caller holds pager->lock. Returns
+the number of pages written.
+*/
+uint32_t pager_write_back(Pager* pager) {
+  uint32_t num_dirty;
+  uint32_t* dirty_pages = pager_dirty_pages(pager, &num_dirty);
+  struct iovec iov[WRITE_BATCH_PAGES];
+
+  uint32_t i = 0;
+  while (i < num_dirty) {
+    uint32_t first_page = dirty_pages[i];
+    int run = 0;
+    while (i < num_dirty && run < WRITE_BATCH_PAGES &&
+           dirty_pages[i] == first_page + run) {
+      Frame* frame = &pager->frames[page_table_lookup(pager, dirty_pages[i])];
+      iov[run].iov_base = frame->data;
+      iov[run].iov_len = PAGE_SIZE;
+      frame->dirty = false;
+      run++;
+      i++;
+    }
+    pager->pages_compressed += pager_write_pages(pager, first_page, iov, run);
+    pager_extend_file(pager, (off_t)(first_page + run) * PAGE_SIZE);
+  }
+  free(dirty_pages);
+
+  if (num_dirty > 0) {
+    if (fsync(pager->file_descriptor) == -1) {
+      printf("Error syncing db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->checkpoints++;
+    pager->pages_written += num_dirty;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &pager->last_checkpoint);
+  return num_dirty;
+}
+
+void wal_checkpoint(Pager* pager);
+
+/*
+Close the current group: append every dirty page, the last one marked as
+the commit frame, and make the whole group durable with a single fsync.
+Caller holds pager->lock.
+*/
+void wal_commit(Pager* pager) {
+  Wal* wal = pager->wal;
+
+  uint32_t num_dirty;
+  uint32_t* dirty_pages = pager_dirty_pages(pager, &num_dirty);
+
+  pthread_mutex_lock(&wal->lock);
+  bool spilled = wal->num_frames > wal->num_committed;
+  pthread_mutex_unlock(&wal->lock);
+
+  if (num_dirty == 0 && !spilled) {
+    wal->pending_statements = 0;
+    free(dirty_pages);
+    return;
+  }
+  if (num_dirty == 0) {
+    /*
+    Everything the group changed was already spilled by eviction: log
+    page 0 again just to carry the commit mark
+    */
+    get_page(pager, 0);
+    pager_unpin(pager, 0);
+    dirty_pages[num_dirty++] = 0;
+  }
+
+  void** pages = malloc(sizeof(void*) * num_dirty);
+  for (uint32_t i = 0; i < num_dirty; i++) {
+    Frame* frame = &pager->frames[page_table_lookup(pager, dirty_pages[i])];
+    pages[i] = frame->data;
+    frame->dirty = false;
+  }
+  pthread_mutex_lock(&wal->lock);
+  wal_append_frames(wal, num_dirty, dirty_pages, pages, pager->num_pages);
+  pthread_mutex_unlock(&wal->lock);
+  free(pages);
+  free(dirty_pages);
+
+  if (fdatasync(wal->file_descriptor) == -1) {
+    printf("Error syncing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  wal->num_committed = wal->num_frames;
+  wal->committed_db_size = pager->num_pages;
+  wal->pending_statements = 0;
+  wal->commits++;
+  bool checkpoint_due =
+      wal->num_committed - wal->backfilled >= WAL_AUTOCHECKPOINT_FRAMES;
+  bool log_full = wal->num_frames >= WAL_MAX_FRAMES;
+  pthread_mutex_unlock(&wal->lock);
+
+  if (checkpoint_due) {
+    pager_wake_background(pager);
+  }
+  if (log_full) {
+    // Nothing can be appended while we hold the statement lock
+    wal_checkpoint(pager);
+  }
+}
+
+/*
+Called once a statement no longer holds any page pointers. Statements that
+changed pages join the open group, which commits once it is full. Without
+a WAL they instead write back the dirty pages once a checkpoint is due.
+*/
+void pager_end_statement(Pager* pager, bool modified) {
+  pager->epoch++;
+
+  Wal* wal = pager->wal;
+  if (!modified || pager->mode == PAGER_MMAP) {
+    return;
+  }
+  if (wal == NULL) {
+    if (elapsed_ms(&pager->last_checkpoint) >= CHECKPOINT_INTERVAL_MS) {
+      pager_write_back(pager);
+    }
+    return;
+  }
+  if (wal->pending_statements++ == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &wal->group_start);
+  }
+  if (wal->pending_statements >= wal->group_size ||
+      elapsed_ms(&wal->group_start) >= WAL_COMMIT_WINDOW_MS) {
+    wal_commit(pager);
+  }
+}
+
+/*
+Commits the open group now. Called before the statements in it are
+acknowledged, so that no reply reports a statement a crash would lose.
+*/
+void pager_commit(Pager* pager) {
+  pthread_mutex_lock(&pager->lock);
+  if (pager->wal && pager->wal->pending_statements > 0) {
+    wal_commit(pager);
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void wal_write_header(Wal* wal) {
+  WalHeader header = {WAL_MAGIC, WAL_VERSION, PAGE_SIZE, wal->salt};
+  if (pwrite(wal->file_descriptor, &header, sizeof(header), 0) == -1 ||
+      ftruncate(wal->file_descriptor, sizeof(header)) == -1) {
+    printf("Error writing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+Start the log over once every frame in it is in the main file. Caller
+holds wal->lock.
+*/
+void wal_reset(Wal* wal) {
+  for (uint32_t i = 0; i < wal->num_frames; i++) {
+    wal->page_frames[wal->frame_pages[i]] = 0;
+  }
+  wal->num_frames = 0;
+  wal->num_committed = 0;
+  wal->backfilled = 0;
+  __atomic_store_n(&wal->generation, wal->generation + 1, __ATOMIC_RELEASE);
+  wal->salt = wal->salt * 1103515245 + 12345;
+  wal_write_header(wal);
+}
+
+/*
+Copy the latest committed image of every page into the main file, in page
+order, writing each run of consecutive pages with one pwrite. Frames before
+`backfilled` are already there, so only the frames committed since the
+last checkpoint are looked at. This usually runs on the background thread
+while statements keep going: frames up to the snapshot never change until
+the log is reset, and the reset only happens when nothing was appended
+since the snapshot.
+*/
+void wal_checkpoint(Pager* pager) {
+  Wal* wal = pager->wal;
+  pthread_mutex_lock(&wal->checkpoint_lock);
+
+  pthread_mutex_lock(&wal->lock);
+  uint32_t first = wal->backfilled;
+  uint32_t snapshot = wal->num_committed;
+  uint32_t db_size = wal->committed_db_size;
+  uint32_t num_entries = snapshot - first;
+  uint64_t* entries = malloc(sizeof(uint64_t) * (num_entries + 1));
+  for (uint32_t i = 0; i < num_entries; i++) {
+    entries[i] = ((uint64_t)wal->frame_pages[first + i] << 32) | (first + i);
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  qsort(entries, num_entries, sizeof(uint64_t), compare_uint64);
+  // Keep only the newest frame of each page
+  uint32_t num_pages = 0;
+  for (uint32_t i = 0; i < num_entries; i++) {
+    if (i + 1 < num_entries && (entries[i + 1] >> 32) == (entries[i] >> 32)) {
+      continue;
+    }
+    entries[num_pages++] = entries[i];
+  }
+
+  char* run_data = malloc((size_t)WRITE_BATCH_PAGES * PAGE_SIZE);
+  struct iovec iov[WRITE_BATCH_PAGES];
+  uint32_t num_compressed = 0;
+  uint32_t i = 0;
+  while (i < num_pages) {
+    uint32_t first_page = entries[i] >> 32;
+    uint32_t run = 0;
+    while (i < num_pages && run < WRITE_BATCH_PAGES &&
+           (entries[i] >> 32) == first_page + run) {
+      off_t offset = wal_frame_offset((uint32_t)entries[i]) + sizeof(WalFrameHeader);
+      iov[run].iov_base = run_data + (size_t)run * PAGE_SIZE;
+      iov[run].iov_len = PAGE_SIZE;
+      if (pread(wal->file_descriptor, iov[run].iov_base, PAGE_SIZE, offset) == -1) {
+        printf("Error checkpointing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      run++;
+      i++;
+    }
+    num_compressed += pager_write_pages(pager, first_page, iov, run);
+  }
+  free(run_data);
+  free(entries);
+
+  if (num_entries > 0 && fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  pager_extend_file(pager, (off_t)db_size * PAGE_SIZE);
+  if (num_entries > 0) {
+    pager->checkpoints++;
+    pager->pages_written += num_pages;
+    pager->pages_compressed += num_compressed;
+  }
+  wal->backfilled = snapshot;
+  if (wal->num_frames == snapshot) {
+    wal_reset(wal);
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  pthread_mutex_unlock(&wal->checkpoint_lock);
+}
+
+/*
+Background thread of a buffered pager. With a WAL it checkpoints once the
+log holds enough committed frames and commits a group the REPL left open
+while it sits waiting for input. Without one it writes back dirty pages
+every CHECKPOINT_INTERVAL_MS. While statements are running the REPL does
+this work itself, so the thread only ever tries the statement lock.
+*/
+void* pager_background_main(void* arg) {
+  Pager* pager = arg;
+  Wal* wal = pager->wal;
+  long interval_ms = wal ? WAL_COMMIT_WINDOW_MS : CHECKPOINT_INTERVAL_MS;
+
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);  // they are for the main thread
+
+  pthread_mutex_lock(&pager->background_lock);
+  while (!pager->stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += interval_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&pager->background_wake, &pager->background_lock,
+                           &deadline);
+    if (pager->stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&pager->background_lock);
+
+    if (wal) {
+      pthread_mutex_lock(&wal->lock);
+      bool checkpoint_due =
+          wal->num_committed - wal->backfilled >= WAL_AUTOCHECKPOINT_FRAMES;
+      pthread_mutex_unlock(&wal->lock);
+      if (checkpoint_due) {
+        wal_checkpoint(pager);
+      }
+    }
+
+    if (pthread_mutex_trylock(&pager->lock) == 0) {
+      if (wal && wal->pending_statements > 0 &&
+          elapsed_ms(&wal->group_start) >= WAL_COMMIT_WINDOW_MS) {
+        wal_commit(pager);
+      } else if (!wal &&
+                 elapsed_ms(&pager->last_checkpoint) >= CHECKPOINT_INTERVAL_MS) {
+        pager_write_back(pager);
+      }
+      pthread_mutex_unlock(&pager->lock);
+    }
+    pthread_mutex_lock(&pager->background_lock);
+  }
+  pthread_mutex_unlock(&pager->background_lock);
+  return NULL;
+}
+
+void pager_start_background(Pager* pager) {
+  pager->stopping = false;
+  pthread_mutex_init(&pager->background_lock, NULL);
+  pthread_cond_init(&pager->background_wake, NULL);
+  pthread_create(&pager->background, NULL, pager_background_main, pager);
+  pager->background_running = true;
+}
+
+void pager_stop_background(Pager* pager) {
+  if (!pager->background_running) {
+    return;
+  }
+  pthread_mutex_lock(&pager->background_lock);
+  pager->stopping = true;
+  pthread_cond_signal(&pager->background_wake);
+  pthread_mutex_unlock(&pager->background_lock);
+  pthread_join(pager->background, NULL);
+  pthread_mutex_destroy(&pager->background_lock);
+  pthread_cond_destroy(&pager->background_wake);
+  pager->background_running = false;
+}
+
+char* wal_path(const char* filename) {
+  char* path = malloc(strlen(filename) + 5);
+  sprintf(path, "%s-wal", filename);
+  return path;
+}
+
+/*
+Replay a log left behind by a crash: copy every frame up to the last valid
+commit frame into the main file. Frames after it belong to a group that
+never committed and are dropped.
+*/
+void wal_recover(int db_file_descriptor, const char* filename) {
+  char* path = wal_path(filename);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    free(path);
+    return;  // clean shutdown, nothing to replay
+  }
+
+  WalHeader header;
+  uint32_t last_commit = 0;  // frames [0, last_commit) are committed
+  void* page = NULL;
+  if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+      header.magic == WAL_MAGIC && header.version == WAL_VERSION &&
+      page_size_valid(header.page_size)) {
+    /* The log may hold the only copy of a new file's header page */
+    PAGE_SIZE = header.page_size;
+    page = malloc(PAGE_SIZE);
+    WalFrameHeader frame;
+    for (uint32_t i = 0;; i++) {
+      off_t offset = wal_frame_offset(i);
+      if (pread(fd, &frame, sizeof(frame), offset) != sizeof(frame) ||
+          pread(fd, page, PAGE_SIZE, offset + sizeof(frame)) != PAGE_SIZE ||
+          frame.salt != header.salt ||
+          frame.checksum !=
+              wal_checksum(header.salt, frame.page_num, frame.db_size, page)) {
+        break;  // torn or stale tail
+      }
+      if (frame.db_size != 0) {
+        last_commit = i + 1;
+      }
+    }
+
+    for (uint32_t i = 0; i < last_commit; i++) {
+      off_t offset = wal_frame_offset(i);
+      if (pread(fd, &frame, sizeof(frame), offset) == -1 ||
+          pread(fd, page, PAGE_SIZE, offset + sizeof(frame)) == -1 ||
+          pwrite(db_file_descriptor, page, PAGE_SIZE,
+                 (off_t)frame.page_num * PAGE_SIZE) == -1) {
+        printf("Error replaying WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (last_commit > 0 && fsync(db_file_descriptor) == -1) {
+      printf("Error syncing db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(page);
+  close(fd);
+
+  if (last_commit > 0) {
+    printf("Recovered %d frames from %s\n", last_commit, path);
+  }
+  unlink(path);
+  free(path);
+}
+
+void wal_open(Pager* pager, const char* filename, uint32_t group_size) {
+  Wal* wal = malloc(sizeof(Wal));
+  wal->path = wal_path(filename);
+  wal->file_descriptor = open(wal->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (wal->file_descriptor == -1) {
+    printf("Unable to open WAL file\n");
+    exit(EXIT_FAILURE);
+  }
+  wal->salt = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+  wal_write_header(wal);
+
+  wal->num_frames = 0;
+  wal->num_committed = 0;
+  wal->backfilled = 0;
+  wal->committed_db_size = 0;
+  wal->frame_pages = NULL;
+  wal->frame_capacity = 0;
+  wal->page_frames = NULL;
+  wal->page_capacity = 0;
+  wal->generation = 0;
+  wal->group_size = group_size > 0 ? group_size : 1;
+  wal->pending_statements = 0;
+  wal->commits = 0;
+  wal->frames_written = 0;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_mutex_init(&wal->checkpoint_lock, NULL);
+
+  pager->wal = wal;
+}
+
+/*
+Commit whatever is still open, checkpoint everything and remove the log.
+The background thread must already be stopped.
+*/
+void wal_close(Pager* pager) {
+  Wal* wal = pager->wal;
+
+  wal_commit(pager);
+  wal_checkpoint(pager);
+
+  close(wal->file_descriptor);
+  unlink(wal->path);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_mutex_destroy(&wal->checkpoint_lock);
+
+  free(wal->frame_pages);
+  free(wal->page_frames);
+  free(wal->path);
+  free(wal);
+  pager->wal = NULL;
+}
+
+void print_constants() {
+  printf("PAGE_SIZE: %d\n", PAGE_SIZE);
+  printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  printf("LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+  printf("INTERNAL_NODE_MAX_KEYS: %d\n", (int)INTERNAL_NODE_MAX_KEYS);
+}
+
+void print_pager_stats(Pager* pager) {
+  if (pager->mode == PAGER_MMAP) {
+    printf("mode: mmap\n");
+    printf("pages: %d (file %ld bytes, mapped %lu bytes)\n", pager->num_pages,
+           (long)pager->file_length, (unsigned long)pager->map_length);
+    return;
+  }
+
+  printf("mode: buffered\n");
+  uint32_t used = 0, pinned = 0, dirty = 0;
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    Frame* frame = &pager->frames[i];
+    if (frame->page_num == INVALID_PAGE_NUM) {
+      continue;
+    }
+    used++;
+    pinned += (frame->pin_count > 0);
+    dirty += frame->dirty;
+  }
+  printf("frames: %d (used %d, pinned %d, dirty %d)\n", pager->num_frames, used,
+         pinned, dirty);
+  printf("hits: %lu\n", (unsigned long)pager->hits);
+  printf("misses: %lu\n", (unsigned long)pager->misses);
+  printf("evictions: %lu\n", (unsigned long)pager->evictions);
+
+  Wal* wal = pager->wal;
+  if (wal) {
+    pthread_mutex_lock(&wal->lock);
+    printf("wal frames: %d (committed %d)\n", wal->num_frames, wal->num_committed);
+    printf("wal commits: %lu\n", (unsigned long)wal->commits);
+    printf("wal frames written: %lu\n", (unsigned long)wal->frames_written);
+  }
+  printf("checkpoints: %lu\n", (unsigned long)pager->checkpoints);
+  printf("pages written back: %lu (compressed %lu)\n",
+         (unsigned long)pager->pages_written, (unsigned long)pager->pages_compressed);
+  if (wal) {
+    pthread_mutex_unlock(&wal->lock);
+  }
+}
+
+/*
+Make every change so far durable in the main file. Caller holds
+pager->lock. Returns the number of pages written, or -1 for mmap.
+*/
+int pager_checkpoint(Pager* pager) {
+  if (pager->mode == PAGER_MMAP) {
+    if (msync(pager->map, (size_t)pager->num_pages * PAGE_SIZE, MS_SYNC) == -1) {
+      printf("Error syncing file mapping: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    return -1;
+  }
+  if (pager->wal == NULL) {
+    return pager_write_back(pager);
+  }
+
+  wal_commit(pager);
+  uint64_t before = pager->pages_written;
+  wal_checkpoint(pager);
+  return (int)(pager->pages_written - before);
+}
+
+/*
+Depth of the tree, counted along its leftmost path (every leaf is at the
+same depth)
+*/
+uint32_t table_depth(Table* table) {
+  uint32_t depth = 1;
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_page_num = *internal_node_child(node, 0);
+    pager_unpin(table->pager, page_num);
+    page_num = child_page_num;
+    node = get_page(table->pager, page_num);
+    depth++;
+  }
+  pager_unpin(table->pager, page_num);
+  return depth;
+}
+
+void print_tree_stats(Table* table) {
+  printf("root page: %d\n", table->root_page_num);
+  printf("depth: %d\n", table_depth(table));
+  printf("leaf compression: %s\n", table->compress_leaves ? "on" : "off");
+}
+
+void indent(uint32_t level) {
+  for (uint32_t i = 0; i < level; i++) {
+    printf("  ");
+  }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node)) {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(indentation_level + 1);
+        printf("- %d\n", *leaf_node_key(node, i));
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      if (num_keys > 0) {
+        for (uint32_t i = 0; i < num_keys; i++) {
+          child = *internal_node_child(node, i);
+          print_tree(pager, child, indentation_level + 1);
+
+          indent(indentation_level + 1);
+          printf("- key %d\n", *internal_node_key(node, i));
+        }
+        child = *internal_node_right_child(node);
+        print_tree(pager, child, indentation_level + 1);
+      }
+      break;
+  }
+  pager_unpin(pager, page_num);
+}
+
+/* Length of the domain of an email, from the '@' on, 0 if it has none */
+uint32_t email_domain_length(char* email) {
+  char* at = strchr(email, '@');
+  return at == NULL ? 0 : strlen(at);
+}
+
+/*
+Index of the email domain of `row` in a leaf dictionary, or
+LEAF_DICTIONARY_NONE
+*/
+uint8_t dictionary_find(void* dictionary, Row* row) {
+  uint32_t length = email_domain_length(row->email);
+  if (dictionary == NULL || length == 0) {
+    return LEAF_DICTIONARY_NONE;
+  }
+  char* domain = row->email + strlen(row->email) - length;
+  uint8_t num_entries = *(uint8_t*)dictionary;
+  for (uint32_t i = 0; i < num_entries; i++) {
+    uint8_t* entry = dictionary_entry(dictionary, i);
+    if (entry[0] == length && memcmp(entry + 1, domain, length) == 0) {
+      return i;
+    }
+  }
+  return LEAF_DICTIONARY_NONE;
+}
+
+/*
+Size of the record for `row`. In a compressed leaf the record carries a
+domain index, and the email leaves out the domain when it is in the
+dictionary.
+*/
+uint32_t row_size(Row* row, bool compressed, uint8_t domain) {
+  uint32_t email_length = strlen(row->email);
+  if (domain != LEAF_DICTIONARY_NONE) {
+    email_length -= email_domain_length(row->email);
+  }
+  return ID_SIZE + 2 * STRING_LENGTH_SIZE + strlen(row->username) +
+         email_length + (compressed ? LEAF_DOMAIN_INDEX_SIZE : 0);
+}
+
+void* serialize_string(char* source, uint32_t length, void* destination) {
+  *(uint8_t*)destination = length;
+  memcpy(destination + STRING_LENGTH_SIZE, source, length);
+  return destination + STRING_LENGTH_SIZE + length;
+}
+
+void* deserialize_string(void* source, char* destination) {
+  uint8_t length = *(uint8_t*)source;
+  memcpy(destination, source + STRING_LENGTH_SIZE, length);
+  destination[length] = '\0';
+  return source + STRING_LENGTH_SIZE + length;
+}
+
+void serialize_row(Row* source, bool compressed, uint8_t domain,
+                   void* destination) {
+  uint32_t email_length = strlen(source->email);
+  if (domain != LEAF_DICTIONARY_NONE) {
+    email_length -= email_domain_length(source->email);
+  }
+  memcpy(destination, &(source->id), ID_SIZE);
+  destination = serialize_string(source->username, strlen(source->username),
+                                 destination + ID_SIZE);
+  destination = serialize_string(source->email, email_length, destination);
+  if (compressed) {
+    *(uint8_t*)destination = domain;
+  }
+}
+
+/*
+Decode a record. `dictionary` is the leaf's dictionary, NULL when the leaf
+is not compressed.
+*/
+void deserialize_row(void* source, void* dictionary, Row* destination) {
+  memcpy(&(destination->id), source, ID_SIZE);
+  source = deserialize_string(source + ID_SIZE, destination->username);
+  source = deserialize_string(source, destination->email);
+  if (dictionary != NULL && *(uint8_t*)source != LEAF_DICTIONARY_NONE) {
+    uint8_t* entry = dictionary_entry(dictionary, *(uint8_t*)source);
+    char* end = destination->email + strlen(destination->email);
+    memcpy(end, entry + 1, entry[0]);
+    end[entry[0]] = '\0';
+  }
+}
+
+void initialize_leaf_node(void* node) {
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);
+  *leaf_node_num_cells(node) = 0;
+  *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+  *node_high_key(node) = 0;
+  *leaf_node_content_start(node) = PAGE_SIZE;
+  *leaf_node_dictionary_offset(node) = 0;
+}
+
+void initialize_internal_node(void* node) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *node_right_link(node) = 0;
+  *node_high_key(node) = 0;
+  *internal_node_num_keys(node) = 0;
+  /*
+  A zeroed right child would read as page 0, the file header, so a node
+  whose right child was never set would lead into the header. An invalid
+  page number makes internal_node_child and get_page report it instead.
+  */
+  *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+/* How many of the `count` keys are below `key` */
+uint32_t keys_below_scalar(const uint32_t* keys, uint32_t count, uint32_t key) {
+  uint32_t below = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    below += keys[i] < key;
+  }
+  return below;
+}
+
+#if defined(__x86_64__)
+/*
+SIMD has no unsigned 32-bit compare, so both sides get their sign bit
+flipped and are compared as signed. Each compare covers a block of keys and
+movemask turns the result into one bit per key.
+*/
+uint32_t keys_below_sse2(const uint32_t* keys, uint32_t count, uint32_t key) {
+  __m128i bias = _mm_set1_epi32(INT32_MIN);
+  __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+  uint32_t below = 0, i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+    __m128i less = _mm_cmpgt_epi32(target, block);
+    below += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+  }
+  return below + keys_below_scalar(keys + i, count - i, key);
+}
+
+__attribute__((target("avx2,popcnt")))
+uint32_t keys_below_avx2(const uint32_t* keys, uint32_t count, uint32_t key) {
+  __m256i bias = _mm256_set1_epi32(INT32_MIN);
+  __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+  uint32_t below = 0, i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i block =
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), bias);
+    __m256i less = _mm256_cmpgt_epi32(target, block);
+    below += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+  }
+  return below + keys_below_scalar(keys + i, count - i, key);
+}
+#endif
+
+/*
+Index of the first of `num_keys` sorted keys that is >= `key`. Binary
+search narrows it down to KEY_SEARCH_WINDOW keys (two cache lines), which
+are then counted with SIMD compares: AVX2 when the CPU has it, SSE2 on any
+other x86-64, plain C elsewhere.
+*/
+uint32_t key_search(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  uint32_t low = 0;
+  uint32_t high = num_keys;
+  while (high - low > KEY_SEARCH_WINDOW) {
+    uint32_t middle = low + (high - low) / 2;
+    if (keys[middle] < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return low + keys_below_avx2(keys + low, high - low, key);
+  }
+  return low + keys_below_sse2(keys + low, high - low, key);
+#else
+  return low + keys_below_scalar(keys + low, high - low, key);
+#endif
+}
+
+/*
+Return the index of the cell holding `key`, or the index where it would
+be inserted
+*/
+uint32_t leaf_node_find_cell(void* node, uint32_t key) {
+  return key_search(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+}
+
+/*
+Pin and return the node on `page_num`, first moving right past any node
+whose high key is below `key`: the upper half of a split the parent does
+not list yet. Updates `page_num` to the node returned.
+*/
+void* node_move_right(Pager* pager, uint32_t* page_num, uint32_t key) {
+  void* node = get_page(pager, *page_num);
+  while (*node_right_link(node) != 0 && key > *node_high_key(node)) {
+    uint32_t right_page_num = *node_right_link(node);
+    pager_unpin(pager, *page_num);
+    *page_num = right_page_num;
+    node = get_page(pager, right_page_num);
+  }
+  return node;
+}
+
+Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key,
+                       TreePath* path) {
+  void* node = node_move_right(table->pager, &page_num, key);
+
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->page_num = page_num;
+  cursor->end_of_table = false;
+  cursor->cell_num = leaf_node_find_cell(node, key);
+  cursor->path = *path;
+  cursor->readahead = (ReadAhead){.window = 0};
+  pager_unpin(table->pager, page_num);
+  return cursor;
+}
+
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+  /*
+  Return the index of the child which should contain
+  the given key: the first key to its right that is >= key, or the right
+  child (index num_keys) if there is none.
+  */
+  return key_search(internal_node_keys(node), *internal_node_num_keys(node), key);
+}
+
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key,
+                           TreePath* path) {
+  void* node = node_move_right(table->pager, &page_num, key);
+  if (path->depth == BTREE_MAX_DEPTH) {
+    printf("Tree deeper than %d levels.\n", BTREE_MAX_DEPTH);
+    exit(EXIT_FAILURE);
+  }
+  path->pages[path->depth++] = page_num;
+
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+  pager_unpin(table->pager, page_num);
+
+  void* child = get_page(table->pager, child_num);
+  NodeType child_type = get_node_type(child);
+  pager_unpin(table->pager, child_num);
+  switch (child_type) {
+    case NODE_LEAF:
+      return leaf_node_find(table, child_num, key, path);
+    case NODE_INTERNAL:
+      return internal_node_find(table, child_num, key, path);
+  }
+}
+
+/*
+Return the position of the given key.
+If the key is not present, return the position
+where it should be inserted. The cursor keeps the
+internal nodes passed on the way down for splits.
+*/
+Cursor* table_find(Table* table, uint32_t key) {
+  uint32_t root_page_num = table->root_page_num;
+  void* root_node = get_page(table->pager, root_page_num);
+  NodeType root_type = get_node_type(root_node);
+  pager_unpin(table->pager, root_page_num);
+
+  TreePath path = {.depth = 0};
+  if (root_type == NODE_LEAF) {
+    return leaf_node_find(table, root_page_num, key, &path);
+  } else {
+    return internal_node_find(table, root_page_num, key, &path);
+  }
+}
+
+/*
+Set up read-ahead for a walk starting at the leaf that holds `key`: that
+leaf's parent is the last node on the path. Nothing is read ahead until
+the walk first leaves the leaf, so a lookup that stays in it costs
+nothing.
+*/
+void readahead_start(ReadAhead* readahead, Table* table, TreePath* path,
+                     uint32_t key) {
+  *readahead = (ReadAhead){.window = table->readahead_leaves};
+  if (readahead->window == 0 || path->depth == 0) {
+    return;
+  }
+  uint32_t parent_page_num = path->pages[path->depth - 1];
+  void* parent = node_move_right(table->pager, &parent_page_num, key);
+  readahead->parent_page_num = parent_page_num;
+  readahead->child_index = internal_node_find_child(parent, key) + 1;
+  pager_unpin(table->pager, parent_page_num);
+}
+
+/*
+Called as the walk steps onto the next leaf. Once half the window has
+been used up, the leaves to refill it are advised in one batch.
+*/
+void readahead_advance(ReadAhead* readahead, Pager* pager) {
+  if (readahead->ahead > 0) {
+    readahead->ahead--;
+  }
+  if (readahead->parent_page_num == 0 || readahead->ahead > readahead->window / 2) {
+    return;
+  }
+
+  uint32_t* pages = malloc(sizeof(uint32_t) * readahead->window);
+  uint32_t num_pages = 0;
+  while (readahead->ahead < readahead->window && readahead->parent_page_num != 0) {
+    uint32_t parent_page_num = readahead->parent_page_num;
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    while (readahead->child_index <= num_keys && readahead->ahead < readahead->window) {
+      uint32_t index = readahead->child_index++;
+      pages[num_pages++] = index < num_keys ? internal_node_children(parent)[index]
+                                            : *internal_node_right_child(parent);
+      readahead->ahead++;
+    }
+    if (readahead->child_index > num_keys) {
+      readahead->parent_page_num = *node_right_link(parent);
+      readahead->child_index = 0;
+    }
+    pager_unpin(pager, parent_page_num);
+  }
+  pager_advise(pager, pages, num_pages);
+  free(pages);
+}
+
+Cursor* table_start(Table* table) {
+  Cursor* cursor = table_find(table, 0);
+  readahead_start(&cursor->readahead, table, &cursor->path, 0);
+
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor->end_of_table = (num_cells == 0);
+  pager_unpin(table->pager, cursor->page_num);
+
+  return cursor;
+}
+
+/*
+Return a cursor at the first row whose id is at least `key`. table_find
+stops one past the last cell when every key in the leaf is smaller, and
+then the row we want is the first one of the next leaf.
+*/
+Cursor* table_seek(Table* table, uint32_t key) {
+  Cursor* cursor = table_find(table, key);
+  readahead_start(&cursor->readahead, table, &cursor->path, key);
+
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(table->pager, page_num);
+  if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      cursor->end_of_table = true;
+    } else {
+      readahead_advance(&cursor->readahead, table->pager);
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+  pager_unpin(table->pager, page_num);
+
+  return cursor;
+}
+
+/*
+Decode the row under the cursor. Records are only decoded here, so a
+compressed leaf costs nothing extra for rows a scan skips.
+*/
+void cursor_value(Cursor* cursor, Row* destination) {
+  uint32_t page_num = cursor->page_num;
+  void* page = get_page(cursor->table->pager, page_num);
+  deserialize_row(leaf_node_value(page, cursor->cell_num),
+                  leaf_node_dictionary(page), destination);
+  pager_unpin(cursor->table->pager, page_num);
+}
+
+void cursor_advance(Cursor* cursor) {
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(cursor->table->pager, page_num);
+
+  cursor->cell_num += 1;
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    /* Advance to next leaf node */
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (next_page_num == 0) {
+      /* This was rightmost leaf */
+      cursor->end_of_table = true;
+    } else {
+      readahead_advance(&cursor->readahead, cursor->table->pager);
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+  pager_unpin(cursor->table->pager, page_num);
+}
+
+Pager* pager_open(const char* filename, PagerOptions* options) {
+  //fd is a file descriptor, an integer that refers to the open file
+  // if the open() function returns -1 it means that the opening operation has failed
+  int fd = open(filename,
+                O_RDWR |      // Read/Write mode
+                    O_CREAT,  // Create file if it does not exist
+                S_IWUSR |     // User write permission
+                    S_IRUSR   // User read permission
+                );
+
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
+  // A log left behind by a crash has to be replayed before anything is read
+  wal_recover(fd, filename);
+  // the lseek() function moves the file offset to the end and returns the length of the file in bytes
+  off_t file_length = lseek(fd, 0, SEEK_END);
+
+  /*
+  An existing file is read with the page size in its header, a new one
+  is created with the page size asked for
+  */
+  uint32_t header[3];  // magic, version, page size
+  if (file_length == 0) {
+    PAGE_SIZE = options->page_size;
+  } else if (pread(fd, header, sizeof(header), DB_MAGIC_OFFSET) == sizeof(header) &&
+             header[0] == DB_MAGIC && page_size_valid(header[2])) {
+    PAGE_SIZE = header[2];
+  }
+
+  Pager* pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->num_pages = (file_length / PAGE_SIZE);
+
+  if (file_length % PAGE_SIZE != 0) {
+    printf("Db file is not a whole number of pages. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pager->mode = options->mode;
+  pager->hits = 0;
+  pager->misses = 0;
+  pager->evictions = 0;
+  pager->wal = NULL;
+  pthread_mutex_init(&pager->lock, NULL);
+  pager->shared = false;
+  pthread_mutex_init(&pager->pool_lock, NULL);
+  pthread_cond_init(&pager->page_loaded, NULL);
+  pager->epoch = 0;
+  pager->snapshot_epochs = NULL;
+  pager->num_snapshots = 0;
+  pager->snapshot_capacity = 0;
+  pager->versions = calloc(VERSION_BUCKETS, sizeof(PageVersion*));
+  pager->num_versions = 0;
+  pthread_cond_init(&pager->page_released, NULL);
+  pager->background_running = false;
+  pager->checkpoints = 0;
+  pager->pages_written = 0;
+  pager->pages_compressed = 0;
+  pager->compress_pages = false;
+  clock_gettime(CLOCK_MONOTONIC, &pager->last_checkpoint);
+
+  if (pager->mode == PAGER_MMAP) {
+    pager->map_length = MMAP_RESERVE_BYTES;
+    while (pager->map_length < (size_t)file_length) {
+      pager->map_length *= 2;
+    }
+    pager->map = mmap(NULL, pager->map_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (pager->map == MAP_FAILED) {
+      printf("Unable to map file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->num_frames = 0;
+    pager->frames = NULL;
+    pager->frame_data = NULL;
+    pager->page_table = NULL;
+    pager->page_table_capacity = 0;
+    return pager;
+  }
+
+  pager->map = NULL;
+  pager->map_length = 0;
+
+  uint32_t num_frames = options->num_frames;
+  if (num_frames < MIN_POOL_FRAMES) {
+    num_frames = MIN_POOL_FRAMES;
+  }
+  pager->num_frames = num_frames;
+  pager->clock_hand = 0;
+  pager->frames = malloc(sizeof(Frame) * num_frames);
+  pager->frame_data = malloc((size_t)num_frames * PAGE_SIZE);
+  for (uint32_t i = 0; i < num_frames; i++) {
+    pager->frames[i].page_num = INVALID_PAGE_NUM;
+    pager->frames[i].pin_count = 0;
+    pager->frames[i].dirty = false;
+    pager->frames[i].referenced = false;
+    pager->frames[i].loading = false;
+    pager->frames[i].readers = 0;
+    pager->frames[i].data = pager->frame_data + (size_t)i * PAGE_SIZE;
+  }
+
+  pager->page_table_capacity = 1;
+  while (pager->page_table_capacity < 2 * num_frames) {
+    pager->page_table_capacity *= 2;
+  }
+  pager->page_table = malloc(sizeof(uint32_t) * pager->page_table_capacity);
+  for (uint32_t i = 0; i < pager->page_table_capacity; i++) {
+    pager->page_table[i] = INVALID_FRAME;
+  }
+
+  if (options->use_wal) {
+    wal_open(pager, filename, options->wal_group_size);
+  }
+  pager_start_background(pager);
+
+  return pager;
+}
+
+uint32_t get_unused_page_num(Pager* pager);
+
+uint16_t row_column_type(Column column) {
+  return column == COLUMN_ID ? COLUMN_TYPE_INTEGER : COLUMN_TYPE_TEXT;
+}
+
+/* The widest value Row has room for in the column */
+uint16_t row_column_size(Column column) {
+  return column == COLUMN_ID         ? ID_SIZE
+         : column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE
+                                     : COLUMN_EMAIL_SIZE;
+}
+
+/* Whether the row's strings fit the widths the table was created with */
+bool table_row_fits(Table* table, Row* row) {
+  return strlen(row->username) <= table->column_sizes[COLUMN_USERNAME] &&
+         strlen(row->email) <= table->column_sizes[COLUMN_EMAIL];
+}
+
+/* Sets up the handle of the table in the next catalog slot */
+Table* database_attach_table(Database* database) {
+  Pager* pager = database->pager;
+  uint32_t slot = database->num_tables;
+  void* catalog = get_page(pager, database->catalog_page_num);
+  void* entry = catalog_entry(catalog, slot);
+
+  /*
+  The table takes its column widths from the entry. Rows are still read
+  into Row, so every column must have Row's type, and a text column no more
+  room than Row gives it.
+  */
+  Table* table = &database->tables[slot];
+  bool layout_fits = *catalog_entry_num_columns(entry) == NUM_COLUMNS;
+  for (Column column = 0; column < NUM_COLUMNS && layout_fits; column++) {
+    uint16_t* layout = catalog_entry_column(entry, column);
+    uint16_t size = layout[1];
+    layout_fits = layout[0] == row_column_type(column) &&
+                  (column == COLUMN_ID ? size == ID_SIZE
+                                       : size > 0 && size <= row_column_size(column));
+    table->column_sizes[column] = size;
+  }
+  if (!layout_fits) {
+    printf("Table '%s' has a column layout this build does not support.\n",
+           catalog_entry_name(entry));
+    exit(EXIT_FAILURE);
+  }
+
+  table->pager = pager;
+  strcpy(table->name, catalog_entry_name(entry));
+  table->catalog_page_num = database->catalog_page_num;
+  table->catalog_slot = slot;
+  table->root_page_num = *catalog_entry_root(entry);
+  table->compress_leaves = database->compress_leaves;
+  for (Column column = 0; column < NUM_COLUMNS; column++) {
+    table->index_roots[column] = *catalog_entry_index_root(entry, column);
+  }
+  /* Scan settings are per connection, so every table shares the first's */
+  table->scan_threads = slot > 0 ? database->tables[0].scan_threads : 1;
+  table->readahead_leaves =
+      slot > 0 ? database->tables[0].readahead_leaves : READAHEAD_DEFAULT_LEAVES;
+  table->scan_unordered = slot > 0 && database->tables[0].scan_unordered;
+  pager_unpin(pager, database->catalog_page_num);
+
+  database->num_tables++;
+  return table;
+}
+
+/*
+Records a new table in the catalog, which must have room for it. Without
+`column_sizes` its columns are as wide as Row's.
+*/
+Table* database_add_table(Database* database, const char* name, uint32_t root_page_num,
+                          uint32_t* index_roots, uint16_t* column_sizes) {
+  void* catalog = get_page(database->pager, database->catalog_page_num);
+  void* entry = catalog_entry(catalog, *catalog_num_tables(catalog));
+  memset(entry, 0, CATALOG_ENTRY_SIZE);
+  strcpy(catalog_entry_name(entry), name);
+  *catalog_entry_root(entry) = root_page_num;
+  for (Column column = 0; column < NUM_COLUMNS; column++) {
+    *catalog_entry_index_root(entry, column) = index_roots ? index_roots[column] : 0;
+    uint16_t* layout = catalog_entry_column(entry, column);
+    layout[0] = row_column_type(column);
+    layout[1] = column_sizes ? column_sizes[column] : row_column_size(column);
+  }
+  *catalog_entry_num_columns(entry) = NUM_COLUMNS;
+  *catalog_num_tables(catalog) += 1;
+  pager_mark_dirty(database->pager, database->catalog_page_num);
+  pager_unpin(database->pager, database->catalog_page_num);
+  return database_attach_table(database);
+}
+
+/* The table called `name`, or DEFAULT_TABLE_NAME if it is empty; NULL if none */
+Table* database_table(Database* database, const char* name) {
+  if (name[0] == '\0') {
+    name = DEFAULT_TABLE_NAME;
+  }
+  for (uint32_t i = 0; i < database->num_tables; i++) {
+    if (strcmp(database->tables[i].name, name) == 0) {
+      return &database->tables[i];
+    }
+  }
+  return NULL;
+}
+
+/* Writes the table's root pages back to its catalog entry */
+void table_save(Table* table) {
+  void* catalog = get_page(table->pager, table->catalog_page_num);
+  void* entry = catalog_entry(catalog, table->catalog_slot);
+  *catalog_entry_root(entry) = table->root_page_num;
+  for (Column column = 0; column < NUM_COLUMNS; column++) {
+    *catalog_entry_index_root(entry, column) = table->index_roots[column];
+  }
+  pager_mark_dirty(table->pager, table->catalog_page_num);
+  pager_unpin(table->pager, table->catalog_page_num);
+}
+
+uint32_t new_table_root(Pager* pager) {
+  uint32_t root_page_num = get_unused_page_num(pager);
+  void* root_node = get_page(pager, root_page_num);
+  initialize_leaf_node(root_node);
+  set_node_root(root_node, true);
+  pager_mark_dirty(pager, root_page_num);
+  pager_unpin(pager, root_page_num);
+  return root_page_num;
+}
+
+/* An empty catalog on a fresh page, whose number goes into the header */
+uint32_t new_catalog(Pager* pager, void* header) {
+  uint32_t catalog_page_num = get_unused_page_num(pager);
+  void* catalog = get_page(pager, catalog_page_num);
+  *catalog_num_tables(catalog) = 0;
+  pager_mark_dirty(pager, catalog_page_num);
+  pager_unpin(pager, catalog_page_num);
+  *db_header_field(header, DB_CATALOG_PAGE_OFFSET) = catalog_page_num;
+  pager_mark_dirty(pager, 0);
+  return catalog_page_num;
+}
+
+Database* db_open(const char* filename, PagerOptions* options) {
+  Pager* pager = pager_open(filename, options);
+
+  Database* database = malloc(sizeof(Database));
+  database->pager = pager;
+  database->num_tables = 0;
+
+  pthread_mutex_lock(&pager->lock);
+  bool new_file = pager->num_pages == 0;
+  void* header = get_page(pager, 0);
+  uint32_t version = *db_header_field(header, DB_VERSION_OFFSET);
+  if (new_file) {
+    /*
+    New database file. Page 0 is the header, the catalog and the root leaf
+    of the default table go on the pages after it.
+    */
+    *db_header_field(header, DB_MAGIC_OFFSET) = DB_MAGIC;
+    *db_header_field(header, DB_VERSION_OFFSET) = DB_VERSION;
+    *db_header_field(header, DB_PAGE_SIZE_OFFSET) = PAGE_SIZE;
+    *db_header_field(header, DB_FREELIST_TRUNK_OFFSET) = 0;
+    *db_header_field(header, DB_FREELIST_COUNT_OFFSET) = 0;
+    *db_header_field(header, DB_FLAGS_OFFSET) = 0;
+    pager_mark_dirty(pager, 0);
+  } else if (*db_header_field(header, DB_MAGIC_OFFSET) != DB_MAGIC ||
+             version != DB_VERSION ||
+             *db_header_field(header, DB_PAGE_SIZE_OFFSET) != PAGE_SIZE) {
+    printf("Not a database file, or written by an incompatible version.\n");
+    exit(EXIT_FAILURE);
+  }
+  /*
+  Leaves say for themselves whether they are compressed, so compression
+  can be turned on for an existing file; it applies from then on. The same
+  goes for pages, which are checked for compression whenever they are read.
+  */
+  uint32_t* flags = db_header_field(header, DB_FLAGS_OFFSET);
+  bool modified = new_file;
+  uint32_t wanted = (options->compress_leaves ? DB_FLAG_COMPRESS_LEAVES : 0) |
+                    (options->compress_pages ? DB_FLAG_COMPRESS_PAGES : 0);
+  if ((*flags & wanted) != wanted) {
+    *flags |= wanted;
+    pager_mark_dirty(pager, 0);
+    modified = true;
+  }
+  if ((*flags & DB_FLAG_COMPRESS_PAGES) && pager->mode == PAGER_MMAP) {
+    printf("Page compression does not work with --mmap.\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->compress_pages = *flags & DB_FLAG_COMPRESS_PAGES;
+  database->compress_leaves = *flags & DB_FLAG_COMPRESS_LEAVES;
+  database->tables = malloc(sizeof(Table) * CATALOG_MAX_TABLES);
+
+  if (new_file) {
+    database->catalog_page_num = new_catalog(pager, header);
+    database_add_table(database, DEFAULT_TABLE_NAME, new_table_root(pager), NULL, NULL);
+  } else {
+    database->catalog_page_num = *db_header_field(header, DB_CATALOG_PAGE_OFFSET);
+    void* catalog = get_page(pager, database->catalog_page_num);
+    uint32_t num_tables = *catalog_num_tables(catalog);
+    pager_unpin(pager, database->catalog_page_num);
+    while (database->num_tables < num_tables) {
+      database_attach_table(database);
+    }
+  }
+  pager_unpin(pager, 0);
+  pager_end_statement(pager, modified);
+  pthread_mutex_unlock(&pager->lock);
+
+  return database;
+}
+
+InputBuffer* new_input_buffer() {
+  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+  input_buffer->read_ahead = NULL;
+  input_buffer->read_ahead_start = 0;
+  input_buffer->read_ahead_end = 0;
+
+  return input_buffer;
+}
+
+void print_prompt() { printf("db > "); }
+
+#define INPUT_READ_SIZE (64 * 1024)
+
+/* Append `length` bytes to the line being read */
+void input_append(InputBuffer* input_buffer, const char* bytes, size_t length) {
+  size_t needed = input_buffer->input_length + length + 1;
+  if (input_buffer->buffer_length < needed) {
+    input_buffer->buffer_length = needed * 2;
+    input_buffer->buffer = realloc(input_buffer->buffer, input_buffer->buffer_length);
+  }
+  memcpy(input_buffer->buffer + input_buffer->input_length, bytes, length);
+  input_buffer->input_length += length;
+  input_buffer->buffer[input_buffer->input_length] = '\0';
+}
+
+/*
+Read the next line from stdin, without its newline. stdin is read in
+blocks into read_ahead, so a script piped in costs one read per block
+and input_pending can tell whether the next line is already here. A
+last line without a newline is still returned. False once there is
+nothing left to read.
+*/
+bool read_input(InputBuffer* input_buffer) {
+  if (input_buffer->read_ahead == NULL) {
+    input_buffer->read_ahead = malloc(INPUT_READ_SIZE);
+  }
+  input_buffer->input_length = 0;
+  input_append(input_buffer, "", 0);
+
+  while (true) {
+    char* start = input_buffer->read_ahead + input_buffer->read_ahead_start;
+    size_t available = input_buffer->read_ahead_end - input_buffer->read_ahead_start;
+    char* newline = memchr(start, '\n', available);
+    if (newline != NULL) {
+      input_append(input_buffer, start, newline - start);
+      input_buffer->read_ahead_start += newline - start + 1;
+      return true;
+    }
+    input_append(input_buffer, start, available);
+    input_buffer->read_ahead_start = 0;
+    input_buffer->read_ahead_end = 0;
+
+    ssize_t bytes_read = read(STDIN_FILENO, input_buffer->read_ahead, INPUT_READ_SIZE);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      return input_buffer->input_length > 0;
+    }
+    input_buffer->read_ahead_end = bytes_read;
+  }
+}
+
+/* Whether the next line can be read without waiting for it */
+bool input_pending(InputBuffer* input_buffer) {
+  if (input_buffer->read_ahead_start < input_buffer->read_ahead_end &&
+      memchr(input_buffer->read_ahead + input_buffer->read_ahead_start, '\n',
+             input_buffer->read_ahead_end - input_buffer->read_ahead_start) != NULL) {
+    return true;
+  }
+  struct pollfd ready = {.fd = STDIN_FILENO, .events = POLLIN};
+  return poll(&ready, 1, 0) == 1 && (ready.revents & POLLIN);
+}
+
+void close_input_buffer(InputBuffer* input_buffer) {
+  free(input_buffer->buffer);
+  free(input_buffer->read_ahead);
+  free(input_buffer);
+}
+
+void mmap_pager_close(Pager* pager) {
+  size_t used_length = (size_t)pager->num_pages * PAGE_SIZE;
+
+  if (msync(pager->map, used_length, MS_SYNC) == -1) {
+    printf("Error syncing file mapping: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  munmap(pager->map, pager->map_length);
+
+  /* Give back the unused tail of the last growth chunk */
+  if (ftruncate(pager->file_descriptor, used_length) == -1) {
+    printf("Error truncating file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void db_close(Database* database) {
+  Pager* pager = database->pager;
+
+  pager_stop_background(pager);
+  if (pager->mode == PAGER_MMAP) {
+    mmap_pager_close(pager);
+  } else if (pager->wal) {
+    wal_close(pager);
+  } else {
+    pager_write_back(pager);
+  }
+
+  int result = close(pager->file_descriptor);
+  if (result == -1) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_destroy(&pager->lock);
+  free(pager->page_table);
+  free(pager->versions);  // emptied when the last snapshot ended
+  free(pager->snapshot_epochs);
+  free(pager->frame_data);
+  free(pager->frames);
+  free(pager);
+  free(database->tables);
+  free(database);
+}
+
+/*
+The REPL's replies wait in stdout's buffer until the statements they
+acknowledge are committed. Only repl_commit flushes it: before the REPL
+waits for input, and before anything it prints could fill the buffer.
+*/
+#define REPL_OUTPUT_SIZE (64 * 1024)
+#define REPL_MESSAGE_ROOM 256  // the prompt and a message, besides the input it quotes
+
+void repl_commit(Database* database) {
+  pager_commit(database->pager);
+  fflush(stdout);
+}
+
+bool timer_enabled = false;  // toggled by .timer, reports per-statement time
+ResultSink result_sink;      // where select writes, set by .mode and .output
+__thread StatementCache statement_cache;  // compiled statements, by text
+
+void execute_load(Table* table, const char* path, uint32_t fill_percent);
+
+/* The table a meta command names, reporting it when there is none */
+Table* meta_command_table(Database* database, const char* name) {
+  Table* table = database_table(database, name == NULL ? "" : name);
+  if (table == NULL) {
+    printf("No such table '%s'.\n", name);
+  }
+  return table;
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Database* database) {
+  Table* table;
+
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    close_input_buffer(input_buffer);
+    db_close(database);
+    exit(EXIT_SUCCESS);
+  } else if (strcmp(input_buffer->buffer, ".tables") == 0) {
+    for (uint32_t i = 0; i < database->num_tables; i++) {
+      printf("%s\n", database->tables[i].name);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".btree", 6) == 0 &&
+             (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+    strtok(input_buffer->buffer, " ");
+    if ((table = meta_command_table(database, strtok(NULL, " "))) == NULL) {
+      return META_COMMAND_SUCCESS;
+    }
+    printf("Tree:\n");
+    pthread_mutex_lock(&table->pager->lock);
+    print_tree(table->pager, table->root_page_num, 0);
+    pager_end_statement(table->pager, false);
+    pthread_mutex_unlock(&table->pager->lock);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+    printf("Constants:\n");
+    print_constants();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".checkpoint") == 0) {
+    pthread_mutex_lock(&database->pager->lock);
+    int pages_written = pager_checkpoint(database->pager);
+    pthread_mutex_unlock(&database->pager->lock);
+    if (pages_written < 0) {
+      printf("Synced file mapping.\n");
+    } else {
+      printf("Checkpointed %d pages.\n", pages_written);
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".stats", 6) == 0 &&
+             (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+    strtok(input_buffer->buffer, " ");
+    if ((table = meta_command_table(database, strtok(NULL, " "))) == NULL) {
+      return META_COMMAND_SUCCESS;
+    }
+    printf("Pager:\n");
+    print_pager_stats(table->pager);
+    printf("Statements:\n");
+    printf("cached programs: %lu hits, %lu misses\n",
+           (unsigned long)statement_cache.hits,
+           (unsigned long)statement_cache.misses);
+    printf("Tree:\n");
+    pthread_mutex_lock(&table->pager->lock);
+    print_tree_stats(table);
+    pager_end_statement(table->pager, false);
+    pthread_mutex_unlock(&table->pager->lock);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char* path = strtok(NULL, " ");
+    char* fill_string = strtok(NULL, " ");
+    char* table_name = NULL;
+    if (fill_string != NULL && (fill_string[0] < '0' || fill_string[0] > '9')) {
+      table_name = fill_string;  // the fill percent was left out
+      fill_string = NULL;
+    } else {
+      table_name = strtok(NULL, " ");
+    }
+    int fill_percent = fill_string ? atoi(fill_string) : LOAD_DEFAULT_FILL_PERCENT;
+    if (path == NULL || fill_percent < 1 || fill_percent > 100) {
+      printf("Usage: .load <file> [fill percent 1-100] [table]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if ((table = meta_command_table(database, table_name)) == NULL) {
+      return META_COMMAND_SUCCESS;
+    }
+    execute_load(table, path, fill_percent);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".mode ", 6) == 0) {
+    char* mode = input_buffer->buffer + 6;
+    if (strcmp(mode, "table") == 0) {
+      result_sink.mode = OUTPUT_TABLE;
+    } else if (strcmp(mode, "csv") == 0) {
+      result_sink.mode = OUTPUT_CSV;
+    } else if (strcmp(mode, "tsv") == 0) {
+      result_sink.mode = OUTPUT_TSV;
+    } else if (strcmp(mode, "binary") == 0) {
+      result_sink.mode = OUTPUT_BINARY;
+    } else {
+      printf("Usage: .mode table|csv|tsv|binary\n");
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".output ", 8) == 0) {
+    char* path = input_buffer->buffer + 8;
+    int fd = STDOUT_FILENO;
+    if (strcmp(path, "stdout") != 0) {
+      fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+      if (fd == -1) {
+        printf("Unable to open file '%s'\n", path);
+        return META_COMMAND_SUCCESS;
+      }
+    }
+    if (result_sink.file_descriptor != STDOUT_FILENO) {
+      close(result_sink.file_descriptor);
+    }
+    result_sink.file_descriptor = fd;
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".threads ", 9) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char* count_string = strtok(NULL, " ");
+    char* order = strtok(NULL, " ");
+    int threads = count_string ? atoi(count_string) : 0;
+    if (threads < 1 || threads > SCAN_MAX_THREADS ||
+        (order != NULL && strcmp(order, "ordered") != 0 &&
+         strcmp(order, "unordered") != 0)) {
+      printf("Usage: .threads <1-%d> [ordered|unordered]\n", SCAN_MAX_THREADS);
+      return META_COMMAND_SUCCESS;
+    }
+    for (uint32_t i = 0; i < database->num_tables; i++) {
+      database->tables[i].scan_threads = threads;
+      database->tables[i].scan_unordered =
+          order != NULL && strcmp(order, "unordered") == 0;
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".readahead ", 11) == 0) {
+    strtok(input_buffer->buffer, " ");
+    char* count_string = strtok(NULL, " ");
+    int leaves = count_string ? atoi(count_string) : -1;
+    if (leaves < 0 || leaves > READAHEAD_MAX_LEAVES) {
+      printf("Usage: .readahead <0-%d>\n", READAHEAD_MAX_LEAVES);
+      return META_COMMAND_SUCCESS;
+    }
+    for (uint32_t i = 0; i < database->num_tables; i++) {
+      database->tables[i].readahead_leaves = leaves;
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".timer on") == 0) {
+    timer_enabled = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".timer off") == 0) {
+    timer_enabled = false;
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+PrepareResult parse_row(char* id_string, char* username, char* email, Row* row) {
+  if (id_string == NULL || username == NULL || email == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  int id = atoi(id_string);
+  if (id < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  if (strlen(username) > COLUMN_USERNAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  if (strlen(email) > COLUMN_EMAIL_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  row->id = id;
+  strcpy(row->username, username);
+  strcpy(row->email, email);
+
+  return PREPARE_SUCCESS;
+}
+
+/* Table names are letters, digits and underscores */
+PrepareResult parse_table_name(char* name, char* destination) {
+  if (name == NULL || name[0] == '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strlen(name) > TABLE_NAME_SIZE) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  for (char* c = name; *c != '\0'; c++) {
+    if (!(*c == '_' || (*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'z') ||
+          (*c >= 'A' && *c <= 'Z'))) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  strcpy(destination, name);
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_id(char* id_string, uint32_t* id) {
+  if (id_string == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  int value = atoi(id_string);
+  if (value < 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+  *id = value;
+  return PREPARE_SUCCESS;
+}
+
+/* Checks a literal or bound value for `column`; strings are not copied */
+PrepareResult parse_value(char* token, Column column, Value* value) {
+  if (column == COLUMN_ID) {
+    value->text = NULL;
+    return parse_id(token, &value->integer);
+  }
+  uint32_t max_length =
+      column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+  if (strlen(token) > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+  value->text = token;
+  return PREPARE_SUCCESS;
+}
+
+void free_program(Program* program) {
+  free(program->text);
+  free(program->instructions);
+  free(program->strings);
+  free(program->parameter_columns);
+  free(program);
+}
+
+void program_emit(Program* program, Opcode opcode, uint8_t p1, uint16_t p2,
+                  uint32_t p3) {
+  if (program->num_instructions == program->instructions_capacity) {
+    program->instructions_capacity =
+        program->instructions_capacity ? 2 * program->instructions_capacity : 8;
+    program->instructions = realloc(
+        program->instructions, sizeof(Instruction) * program->instructions_capacity);
+  }
+  program->instructions[program->num_instructions++] =
+      (Instruction){opcode, p1, p2, p3};
+}
+
+char* compiler_next(Compiler* compiler) {
+  if (compiler->next == compiler->num_tokens) {
+    return NULL;
+  }
+  return compiler->tokens[compiler->next++];
+}
+
+/* Consumes the next token if it is `word` */
+bool compiler_accept(Compiler* compiler, const char* word) {
+  if (compiler->next < compiler->num_tokens &&
+      strcmp(compiler->tokens[compiler->next], word) == 0) {
+    compiler->next++;
+    return true;
+  }
+  return false;
+}
+
+/* Loads the next token, a literal for `column` or a `?`, into r[reg] */
+PrepareResult compile_value(Compiler* compiler, Column column, uint8_t reg) {
+  Program* program = compiler->program;
+  char* token = compiler_next(compiler);
+  if (token == NULL || strcmp(token, ",") == 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (strcmp(token, "?") == 0) {
+    program->parameter_columns[program->num_parameters] = column;
+    program_emit(program, OP_VARIABLE, reg, program->num_parameters++, 0);
+    return PREPARE_SUCCESS;
+  }
+
+  Value value;
+  PrepareResult result = parse_value(token, column, &value);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (column == COLUMN_ID) {
+    program_emit(program, OP_INTEGER, reg, 0, value.integer);
+  } else {
+    uint32_t size = strlen(token) + 1;
+    memcpy(program->strings + program->strings_size, token, size);
+    program_emit(program, OP_STRING, reg, 0, program->strings_size);
+    program->strings_size += size;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/*
+An insert names one or more rows separated by commas:
+insert [into <table>] 1 user1 person1@example.com, 2 user2 person2@example.com
+*/
+PrepareResult compile_insert(Compiler* compiler) {
+  Program* program = compiler->program;
+  program->type = STATEMENT_INSERT;
+  if (compiler_accept(compiler, "into")) {
+    PrepareResult result =
+        parse_table_name(compiler_next(compiler), program->table_name);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+
+  do {
+    /* r0, r1 and r2 hold the id, username and email */
+    for (Column column = COLUMN_ID; column < NUM_COLUMNS; column++) {
+      PrepareResult result = compile_value(compiler, column, column);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+    }
+    program_emit(program, OP_ROW, 0, 0, 0);
+    program->num_rows++;
+  } while (compiler_accept(compiler, ","));
+  program_emit(program, OP_INSERT, 0, 0, 0);
+  return PREPARE_SUCCESS;
+}
+
+/*
+select [count(*)|min(id)|max(id)|sum(id)] [from <table>]
+       [where id = N | where id between A and B | where username|email = X]
+       [limit N]
+r0 and r1 hold the id range, r2 the limit and r3 the value to match.
+*/
+PrepareResult compile_select(Compiler* compiler) {
+  Program* program = compiler->program;
+  program->type = STATEMENT_SELECT;
+  AggregateType aggregate = AGGREGATE_NONE;
+  if (compiler_accept(compiler, "count(*)") || compiler_accept(compiler, "count(id)")) {
+    aggregate = AGGREGATE_COUNT;
+  } else if (compiler_accept(compiler, "min(id)")) {
+    aggregate = AGGREGATE_MIN;
+  } else if (compiler_accept(compiler, "max(id)")) {
+    aggregate = AGGREGATE_MAX;
+  } else if (compiler_accept(compiler, "sum(id)")) {
+    aggregate = AGGREGATE_SUM;
+  }
+
+  PrepareResult result = PREPARE_SUCCESS;
+  if (compiler_accept(compiler, "from")) {
+    result = parse_table_name(compiler_next(compiler), program->table_name);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+
+  bool has_range = false;
+  if (compiler_accept(compiler, "where")) {
+    if (compiler_accept(compiler, "id")) {
+      has_range = true;
+      if (compiler_accept(compiler, "=")) {
+        result = compile_value(compiler, COLUMN_ID, 0);
+        if (result == PREPARE_SUCCESS) {
+          /* The same load again, into r1 */
+          Instruction load = program->instructions[program->num_instructions - 1];
+          program_emit(program, load.opcode, 1, load.p2, load.p3);
+        }
+      } else if (compiler_accept(compiler, "between")) {
+        result = compile_value(compiler, COLUMN_ID, 0);
+        if (result == PREPARE_SUCCESS && !compiler_accept(compiler, "and")) {
+          return PREPARE_SYNTAX_ERROR;
+        }
+        if (result == PREPARE_SUCCESS) {
+          result = compile_value(compiler, COLUMN_ID, 1);
+        }
+      } else {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    } else {
+      Column column;
+      if (compiler_accept(compiler, "username")) {
+        column = COLUMN_USERNAME;
+      } else if (compiler_accept(compiler, "email")) {
+        column = COLUMN_EMAIL;
+      } else {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      if (!compiler_accept(compiler, "=")) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      result = compile_value(compiler, column, 3);
+      program_emit(program, OP_MATCH, 3, column, 0);
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+
+  bool has_limit = compiler_accept(compiler, "limit");
+  if (has_limit) {
+    result = compile_value(compiler, COLUMN_ID, 2);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+
+  if (!has_range) {
+    program_emit(program, OP_INTEGER, 0, 0, 0);
+    program_emit(program, OP_INTEGER, 1, 0, UINT32_MAX);
+  }
+  if (!has_limit) {
+    program_emit(program, OP_INTEGER, 2, 0, UINT32_MAX);
+  }
+  program_emit(program, OP_SELECT, 0, aggregate, 0);
+  return PREPARE_SUCCESS;
+}
+
+/*
+create table <name> [username <width>] [email <width>], or
+create index on [<table>.]username|email
+*/
+PrepareResult compile_create(Compiler* compiler) {
+  Program* program = compiler->program;
+  if (compiler_accept(compiler, "table")) {
+    program->type = STATEMENT_CREATE_TABLE;
+    PrepareResult result =
+        parse_table_name(compiler_next(compiler), program->table_name);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    /* A width narrows a column below Row's */
+    uint16_t sizes[NUM_COLUMNS] = {ID_SIZE, COLUMN_USERNAME_SIZE, COLUMN_EMAIL_SIZE};
+    while (compiler->next < compiler->num_tokens) {
+      Column column = compiler_accept(compiler, "username") ? COLUMN_USERNAME
+                      : compiler_accept(compiler, "email")  ? COLUMN_EMAIL
+                                                            : COLUMN_ID;
+      char* width = compiler_next(compiler);
+      if (column == COLUMN_ID || width == NULL || atoi(width) < 1 ||
+          atoi(width) > row_column_size(column)) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      sizes[column] = atoi(width);
+    }
+    program_emit(program, OP_CREATE_TABLE, 0, sizes[COLUMN_USERNAME],
+                 sizes[COLUMN_EMAIL]);
+    return PREPARE_SUCCESS;
+  }
+
+  program->type = STATEMENT_CREATE_INDEX;
+  if (!compiler_accept(compiler, "index") || !compiler_accept(compiler, "on")) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* column = compiler_next(compiler);
+  if (column == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* dot = strchr(column, '.');
+  if (dot != NULL) {
+    *dot = '\0';
+    PrepareResult result = parse_table_name(column, program->table_name);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    column = dot + 1;
+  }
+  if (strcmp(column, "username") == 0) {
+    program_emit(program, OP_CREATE_INDEX, 0, COLUMN_USERNAME, 0);
+  } else if (strcmp(column, "email") == 0) {
+    program_emit(program, OP_CREATE_INDEX, 0, COLUMN_EMAIL, 0);
+  } else {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return PREPARE_SUCCESS;
+}
+
+/* Compiles `text` into a new program, or returns why it cannot be */
+PrepareResult compile_program(const char* text, Program** compiled) {
+  /*
+  Split the text into words, with each comma a word of its own. Every word
+  gets a terminator, so the words take at most twice the text.
+  */
+  size_t length = strlen(text);
+  char* words = malloc(2 * length + 1);
+  Compiler compiler = {malloc(sizeof(char*) * (length + 1)), 0, 0, NULL};
+  char* word = words;
+  for (const char* c = text; *c != '\0';) {
+    if (*c == ' ') {
+      c++;
+      continue;
+    }
+    compiler.tokens[compiler.num_tokens++] = word;
+    if (*c == ',') {
+      *word++ = *c++;
+    } else {
+      while (*c != '\0' && *c != ' ' && *c != ',') {
+        *word++ = *c++;
+      }
+    }
+    *word++ = '\0';
+  }
+
+  /* Literals and parameters can not outnumber the text's bytes and words */
+  Program* program = calloc(1, sizeof(Program));
+  program->text = strdup(text);
+  program->strings = malloc(length + 1);
+  program->parameter_columns = malloc(compiler.num_tokens + 1);
+  compiler.program = program;
+
+  PrepareResult result = PREPARE_UNRECOGNIZED_STATEMENT;
+  if (compiler_accept(&compiler, "insert")) {
+    result = compile_insert(&compiler);
+  } else if (compiler_accept(&compiler, "select")) {
+    result = compile_select(&compiler);
+  } else if (compiler_accept(&compiler, "create")) {
+    result = compile_create(&compiler);
+  }
+  if (result == PREPARE_SUCCESS && compiler.next < compiler.num_tokens) {
+    result = PREPARE_SYNTAX_ERROR;
+  }
+  free(compiler.tokens);
+  free(words);
+
+  if (result != PREPARE_SUCCESS) {
+    free_program(program);
+    return result;
+  }
+  *compiled = program;
+  return PREPARE_SUCCESS;
+}
+
+uint32_t index_hash(const char* value);
+
+/* The program for `text`: the cached one, or a newly compiled one */
+PrepareResult statement_cache_get(StatementCache* cache, const char* text,
+                                  Program** program) {
+  uint32_t slot = index_hash(text) % STATEMENT_CACHE_SIZE;
+  Program* cached = cache->programs[slot];
+  if (cached != NULL && strcmp(cached->text, text) == 0) {
+    cache->hits++;
+    *program = cached;
+    return PREPARE_SUCCESS;
+  }
+
+  cache->misses++;
+  PrepareResult result = compile_program(text, program);
+  if (result == PREPARE_SUCCESS) {
+    if (cached != NULL) {
+      free_program(cached);
+    }
+    cache->programs[slot] = *program;
+  }
+  return result;
+}
+
+/* Binds `values`, separated by spaces or commas, to the parameters in order */
+PrepareResult bind_parameters(Statement* statement, char* values) {
+  Program* program = statement->program;
+  if (program->num_parameters > STATEMENT_INLINE_PARAMETERS) {
+    statement->parameters = malloc(sizeof(Value) * program->num_parameters);
+  }
+
+  PrepareResult result = PREPARE_SUCCESS;
+  uint32_t num_values = 0;
+  char* position;
+  char* token = values == NULL ? NULL : strtok_r(values, " ,", &position);
+  for (; token != NULL; token = strtok_r(NULL, " ,", &position)) {
+    if (num_values == program->num_parameters) {
+      result = PREPARE_SYNTAX_ERROR;
+      break;
+    }
+    result = parse_value(token, program->parameter_columns[num_values],
+                         &statement->parameters[num_values]);
+    if (result != PREPARE_SUCCESS) {
+      break;
+    }
+    num_values++;
+  }
+  if (result == PREPARE_SUCCESS && num_values < program->num_parameters) {
+    result = PREPARE_SYNTAX_ERROR;
+  }
+
+  if (result != PREPARE_SUCCESS && statement->parameters != statement->inline_parameters) {
+    free(statement->parameters);
+    statement->parameters = statement->inline_parameters;
+  }
+  return result;
+}
+
+PrepareResult prepare_statement(InputBuffer* input_buffer,
+                                Statement* statement) {
+  statement->parameters = statement->inline_parameters;
+  statement->rows_to_insert = &statement->row_to_insert;
+  statement->num_rows_to_insert = 0;
+
+  char* values = strstr(input_buffer->buffer, " ; ");
+  if (values != NULL) {
+    *values = '\0';
+    values += 3;
+  }
+  PrepareResult result =
+      statement_cache_get(&statement_cache, input_buffer->buffer, &statement->program);
+  if (result == PREPARE_SUCCESS) {
+    result = bind_parameters(statement, values);
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  statement->type = statement->program->type;
+  if (statement->program->num_rows > 1) {
+    statement->rows_to_insert = malloc(sizeof(Row) * statement->program->num_rows);
+  }
+  return PREPARE_SUCCESS;
+}
+
+/* Frees what prepare_statement allocated for the statement */
+void close_statement(Statement* statement) {
+  if (statement->rows_to_insert != &statement->row_to_insert) {
+    free(statement->rows_to_insert);
+  }
+  if (statement->parameters != statement->inline_parameters) {
+    free(statement->parameters);
+  }
+}
+
+/*
+Hand out a page for a new node: a page from the freelist when there is
+one, otherwise a new page at the end of the file. The page is reserved
+right away, so calling this twice before touching either page is fine.
+Leaves of the first trunk go first; a trunk is reused once it is empty.
+*/
+uint32_t get_unused_page_num(Pager* pager) {
+  void* header = get_page(pager, 0);
+  uint32_t trunk_page_num = *db_header_field(header, DB_FREELIST_TRUNK_OFFSET);
+
+  if (trunk_page_num == 0) {
+    pager_unpin(pager, 0);
+    return pager->num_pages++;
+  }
+
+  uint32_t page_num;
+  void* trunk = get_page(pager, trunk_page_num);
+  uint32_t num_leaves = *freelist_num_leaves(trunk);
+  if (num_leaves > 0) {
+    page_num = *freelist_leaf(trunk, num_leaves - 1);
+    *freelist_num_leaves(trunk) = num_leaves - 1;
+    pager_mark_dirty(pager, trunk_page_num);
+  } else {
+    page_num = trunk_page_num;
+    *db_header_field(header, DB_FREELIST_TRUNK_OFFSET) = *freelist_next_trunk(trunk);
+  }
+  pager_unpin(pager, trunk_page_num);
+
+  *db_header_field(header, DB_FREELIST_COUNT_OFFSET) -= 1;
+  pager_mark_dirty(pager, 0);
+  pager_unpin(pager, 0);
+  return page_num;
+}
+
+/*
+Give a page that no node uses anymore back to the freelist, for deletes,
+merges and vacuum to call. The page's own contents are only kept when it
+has to become the new first trunk.
+*/
+void pager_free_page(Pager* pager, uint32_t page_num) {
+  void* header = get_page(pager, 0);
+  uint32_t trunk_page_num = *db_header_field(header, DB_FREELIST_TRUNK_OFFSET);
+
+  void* trunk = trunk_page_num ? get_page(pager, trunk_page_num) : NULL;
+  if (trunk && *freelist_num_leaves(trunk) < FREELIST_TRUNK_MAX_LEAVES) {
+    *freelist_leaf(trunk, (*freelist_num_leaves(trunk))++) = page_num;
+    pager_mark_dirty(pager, trunk_page_num);
+  } else {
+    void* new_trunk = get_page(pager, page_num);
+    *freelist_next_trunk(new_trunk) = trunk_page_num;
+    *freelist_num_leaves(new_trunk) = 0;
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+    *db_header_field(header, DB_FREELIST_TRUNK_OFFSET) = page_num;
+  }
+  if (trunk) {
+    pager_unpin(pager, trunk_page_num);
+  }
+
+  *db_header_field(header, DB_FREELIST_COUNT_OFFSET) += 1;
+  pager_mark_dirty(pager, 0);
+  pager_unpin(pager, 0);
+}
+
+void create_new_root(Table* table, TreePath* path, uint32_t left_max_key,
+                     uint32_t right_child_page_num) {
+  /*
+  Handle splitting the root.
+  Old root copied to new page, becomes left child.
+  Address of right child passed in.
+  Re-initialize root page to contain the new root node.
+  New root node points to two children.
+  */
+  if (path->depth == BTREE_MAX_DEPTH) {
+    printf("Tree deeper than %d levels.\n", BTREE_MAX_DEPTH);
+    exit(EXIT_FAILURE);
+  }
 
   void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
   void* left_child = get_page(table->pager, left_child_page_num);
 
-  if (get_node_type(root) == NODE_INTERNAL) {
-    initialize_internal_node(right_child);
-    initialize_internal_node(left_child);
+  /* Left child has data copied from old root */
+  memcpy(left_child, root, PAGE_SIZE);
+  set_node_root(left_child, false);
+
+  /* Root node is a new internal node with one key and two children */
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+  *internal_node_child(root, 0) = left_child_page_num;
+  *internal_node_key(root, 0) = left_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+
+  /* The path gains the root as its first level, the old root moved left */
+  memmove(path->pages + 1, path->pages, path->depth * sizeof(uint32_t));
+  path->pages[0] = table->root_page_num;
+  if (path->depth > 0) {
+    path->pages[1] = left_child_page_num;
+  }
+  path->depth++;
+
+  pager_mark_dirty(table->pager, table->root_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
+  pager_unpin(table->pager, table->root_page_num);
+  pager_unpin(table->pager, left_child_page_num);
+}
+
+/*
+Add a split's new right half to the parent. The node on `level` of the
+path (0 is the root, path->depth the leaf) now ends at `separator`, and
+`new_page_num` holds what it had above that. In the parent the split node
+keeps its slot under `separator` and the new node takes the slot after
+it, with the key the split node had. A full parent splits the same way
+and passes its own separator up a level; the root grows the tree instead.
+*/
+void btree_insert_split(Table* table, TreePath* path, uint32_t level,
+                        uint32_t separator, uint32_t new_page_num) {
+  Pager* pager = table->pager;
+  if (level == 0) {
+    create_new_root(table, path, separator, new_page_num);
+    return;
+  }
+  uint32_t parent_page_num = path->pages[level - 1];
+  void* parent = node_move_right(pager, &parent_page_num, separator);
+  path->pages[level - 1] = parent_page_num;
+
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  uint32_t index = internal_node_find_child(parent, separator);
+  if (num_keys < INTERNAL_NODE_MAX_KEYS) {
+    uint32_t* keys = internal_node_keys(parent);
+    uint32_t* children = internal_node_children(parent);
+    if (index == num_keys) {
+      children[num_keys] = *internal_node_right_child(parent);
+      *internal_node_right_child(parent) = new_page_num;
+    } else {
+      memmove(children + index + 2, children + index + 1,
+              (num_keys - index - 1) * INTERNAL_NODE_CHILD_SIZE);
+      children[index + 1] = new_page_num;
+    }
+    memmove(keys + index + 1, keys + index,
+            (num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+    keys[index] = separator;
+    *internal_node_num_keys(parent) = num_keys + 1;
+    pager_mark_dirty(pager, parent_page_num);
+    pager_unpin(pager, parent_page_num);
+    return;
+  }
+
+  /*
+  Full: lay out the keys and children with the new pair in place, keep
+  the lower half and move the upper half to a new node. Every child has
+  its key here (the right child's is the parent's high key), so nothing
+  below the parent is read.
+  */
+  uint32_t* children = malloc(sizeof(uint32_t) * (INTERNAL_NODE_MAX_KEYS + 2));
+  uint32_t* keys = malloc(sizeof(uint32_t) * (INTERNAL_NODE_MAX_KEYS + 2));
+  uint32_t num_children = 0;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    /* The last child's key is never stored */
+    uint32_t key = i < num_keys ? *internal_node_key(parent, i) : 0;
+    children[num_children] = *internal_node_child(parent, i);
+    if (i == index) {
+      keys[num_children++] = separator;
+      children[num_children] = new_page_num;
+    }
+    keys[num_children++] = key;
+  }
+  uint32_t left_count = num_children / 2;
+  uint32_t left_max = keys[left_count - 1];
+
+  /* The new right half is filled in before the old node links to it */
+  uint32_t right_page_num = get_unused_page_num(pager);
+  void* right = get_page(pager, right_page_num);
+  initialize_internal_node(right);
+  *internal_node_num_keys(right) = num_children - left_count - 1;
+  for (uint32_t i = left_count; i < num_children - 1; i++) {
+    internal_node_children(right)[i - left_count] = children[i];
+    *internal_node_key(right, i - left_count) = keys[i];
+  }
+  *internal_node_right_child(right) = children[num_children - 1];
+  *node_right_link(right) = *node_right_link(parent);
+  *node_high_key(right) = *node_high_key(parent);
+
+  *internal_node_num_keys(parent) = left_count - 1;
+  for (uint32_t i = 0; i < left_count - 1; i++) {
+    internal_node_children(parent)[i] = children[i];
+    *internal_node_key(parent, i) = keys[i];
+  }
+  *internal_node_right_child(parent) = children[left_count - 1];
+  *node_right_link(parent) = right_page_num;
+  *node_high_key(parent) = left_max;
+
+  pager_mark_dirty(pager, parent_page_num);
+  pager_mark_dirty(pager, right_page_num);
+  pager_unpin(pager, parent_page_num);
+  pager_unpin(pager, right_page_num);
+  free(children);
+  free(keys);
+
+  btree_insert_split(table, path, level - 1, left_max, right_page_num);
+}
+
+uint32_t leaf_node_insert_run(Table* table, TreePath* path, uint32_t page_num,
+                              Row* rows, uint32_t num_rows);
+
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
+  void* node = get_page(cursor->table->pager, cursor->page_num);
+
+  void* dictionary = leaf_node_dictionary(node);
+  uint8_t domain = dictionary_find(dictionary, value);
+  uint32_t size = row_size(value, dictionary != NULL, domain);
+  if (leaf_node_free_space(node) < LEAF_NODE_SLOT_SIZE + size) {
+    // Node full
+    leaf_node_insert_run(cursor->table, &cursor->path, cursor->page_num, value, 1);
+    pager_unpin(cursor->table->pager, cursor->page_num);
+    return;
+  }
+
+  serialize_row(value, dictionary != NULL, domain,
+                leaf_node_make_room(node, cursor->cell_num, key, size));
+  pager_mark_dirty(cursor->table->pager, cursor->page_num);
+  pager_unpin(cursor->table->pager, cursor->page_num);
+}
+
+/* FNV-1a */
+uint32_t index_hash(const char* value) {
+  uint32_t hash = 2166136261u;
+  for (; *value != '\0'; value++) {
+    hash ^= (uint8_t)*value;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+char* row_column(Row* row, Column column) {
+  return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+uint64_t index_entry(Row* row, Column column) {
+  return (uint64_t)index_hash(row_column(row, column)) << 32 | row->id;
+}
+
+uint32_t bulk_part_start(uint32_t total, uint32_t parts, uint32_t part);
+
+/* Position of the first entry that is at least `entry` */
+uint32_t index_search(uint64_t* entries, uint32_t count, uint64_t entry) {
+  uint32_t low = 0;
+  uint32_t high = count;
+  while (low < high) {
+    uint32_t middle = (low + high) / 2;
+    if (entries[middle] < entry) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+void initialize_index_node(void* node, NodeType type) {
+  set_node_type(node, type);
+  set_node_root(node, false);
+  *index_node_count(node) = 0;
+  *index_node_link(node) = 0;
+}
+
+/*
+Adds `entry` to the subtree at page_num. A node that is full splits in
+half: the upper half moves to a new page, and that page and the largest
+entry left behind are handed back for the parent to add.
+*/
+bool index_node_insert(Pager* pager, uint32_t page_num, uint64_t entry,
+                       uint64_t* separator, uint32_t* new_page_num) {
+  void* node = get_page(pager, page_num);
+  bool leaf = get_node_type(node) == NODE_LEAF;
+  uint32_t count = *index_node_count(node);
+  uint64_t* entries = index_node_entries(node);
+  uint32_t position = index_search(entries, count, entry);
+
+  uint32_t child_page_num = 0;
+  if (!leaf) {
+    child_page_num = index_node_child(node, position);
+    if (!index_node_insert(pager, child_page_num, entry, &entry, new_page_num)) {
+      pager_unpin(pager, page_num);
+      return false;
+    }
+    /* The child split: `entry` now separates it from *new_page_num */
+  }
+
+  uint32_t max_count = leaf ? INDEX_LEAF_MAX_ENTRIES : INDEX_INTERNAL_MAX_KEYS;
+  uint32_t* children = index_node_children(node);
+  if (count < max_count) {
+    memmove(entries + position + 1, entries + position,
+            (count - position) * INDEX_ENTRY_SIZE);
+    entries[position] = entry;
+    if (!leaf) {
+      memmove(children + position + 1, children + position,
+              (count - position) * sizeof(uint32_t));
+      children[position] = child_page_num;
+      if (position == count) {
+        *index_node_link(node) = *new_page_num;
+      } else {
+        children[position + 1] = *new_page_num;
+      }
+    }
+    *index_node_count(node) = count + 1;
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+    return false;
+  }
+
+  /* Lay out all count + 1 entries (and count + 2 children) before halving */
+  uint64_t* all_entries = malloc(INDEX_ENTRY_SIZE * (count + 1));
+  uint32_t* all_children = malloc(sizeof(uint32_t) * (count + 2));
+  memcpy(all_entries, entries, position * INDEX_ENTRY_SIZE);
+  all_entries[position] = entry;
+  memcpy(all_entries + position + 1, entries + position,
+         (count - position) * INDEX_ENTRY_SIZE);
+  if (!leaf) {
+    for (uint32_t i = 0, j = 0; i <= count; i++) {
+      all_children[j++] = index_node_child(node, i);
+      if (i == position) {
+        all_children[j++] = *new_page_num;
+      }
+    }
+  }
+
+  uint32_t sibling_page_num = get_unused_page_num(pager);
+  void* sibling = get_page(pager, sibling_page_num);
+  initialize_index_node(sibling, leaf ? NODE_LEAF : NODE_INTERNAL);
+  uint32_t left_count = (count + 1) / 2;
+  if (leaf) {
+    uint32_t right_count = count + 1 - left_count;
+    memcpy(entries, all_entries, left_count * INDEX_ENTRY_SIZE);
+    memcpy(index_node_entries(sibling), all_entries + left_count,
+           right_count * INDEX_ENTRY_SIZE);
+    *index_node_count(sibling) = right_count;
+    *index_node_link(sibling) = *index_node_link(node);
+    *index_node_link(node) = sibling_page_num;
+    *separator = all_entries[left_count - 1];
+  } else {
+    /* The middle separator moves up instead of staying in either half */
+    uint32_t right_count = count - left_count;
+    memcpy(entries, all_entries, left_count * INDEX_ENTRY_SIZE);
+    memcpy(children, all_children, left_count * sizeof(uint32_t));
+    *index_node_link(node) = all_children[left_count];
+    memcpy(index_node_entries(sibling), all_entries + left_count + 1,
+           right_count * INDEX_ENTRY_SIZE);
+    memcpy(index_node_children(sibling), all_children + left_count + 1,
+           right_count * sizeof(uint32_t));
+    *index_node_link(sibling) = all_children[count + 1];
+    *index_node_count(sibling) = right_count;
+    *separator = all_entries[left_count];
+  }
+  *index_node_count(node) = left_count;
+  free(all_entries);
+  free(all_children);
+
+  pager_mark_dirty(pager, page_num);
+  pager_mark_dirty(pager, sibling_page_num);
+  pager_unpin(pager, sibling_page_num);
+  pager_unpin(pager, page_num);
+  *new_page_num = sibling_page_num;
+  return true;
+}
+
+void table_set_index_root(Table* table, Column column, uint32_t root_page_num) {
+  table->index_roots[column] = root_page_num;
+  table_save(table);
+}
+
+/* Adds the rows to every index of the table */
+void index_insert_rows(Table* table, Row* rows, uint32_t num_rows) {
+  Pager* pager = table->pager;
+  for (Column column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+    if (table->index_roots[column] == 0) {
+      continue;
+    }
+    for (uint32_t i = 0; i < num_rows; i++) {
+      uint32_t root_page_num = table->index_roots[column];
+      uint64_t separator;
+      uint32_t sibling_page_num;
+      if (!index_node_insert(pager, root_page_num, index_entry(&rows[i], column),
+                             &separator, &sibling_page_num)) {
+        continue;
+      }
+      uint32_t new_root_page_num = get_unused_page_num(pager);
+      void* root = get_page(pager, new_root_page_num);
+      initialize_index_node(root, NODE_INTERNAL);
+      set_node_root(root, true);
+      *index_node_count(root) = 1;
+      index_node_entries(root)[0] = separator;
+      index_node_children(root)[0] = root_page_num;
+      *index_node_link(root) = sibling_page_num;
+      pager_mark_dirty(pager, new_root_page_num);
+      pager_unpin(pager, new_root_page_num);
+      table_set_index_root(table, column, new_root_page_num);
+    }
+  }
+}
+
+/*
+Build an index over entries sorted in order, bottom-up like bulk_build:
+leaves packed to LOAD_DEFAULT_FILL_PERCENT so that the first inserts do
+not split every one of them, internal nodes to full fan-out
+*/
+uint32_t index_build(Pager* pager, uint64_t* entries, uint32_t num_entries) {
+  uint32_t per_leaf = INDEX_LEAF_MAX_ENTRIES * LOAD_DEFAULT_FILL_PERCENT / 100;
+  uint32_t count = num_entries == 0 ? 1 : (num_entries + per_leaf - 1) / per_leaf;
+  uint32_t* pages = malloc(sizeof(uint32_t) * count);
+  uint64_t* max_entries = malloc(INDEX_ENTRY_SIZE * count);
+  for (uint32_t i = 0; i < count; i++) {
+    pages[i] = get_unused_page_num(pager);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t start = bulk_part_start(num_entries, count, i);
+    uint32_t end = bulk_part_start(num_entries, count, i + 1);
+    void* node = get_page(pager, pages[i]);
+    initialize_index_node(node, NODE_LEAF);
+    memcpy(index_node_entries(node), entries + start, (end - start) * INDEX_ENTRY_SIZE);
+    *index_node_count(node) = end - start;
+    *index_node_link(node) = i + 1 < count ? pages[i + 1] : 0;
+    max_entries[i] = end > start ? entries[end - 1] : 0;
+    pager_mark_dirty(pager, pages[i]);
+    pager_unpin(pager, pages[i]);
+  }
+
+  while (count > 1) {
+    uint32_t parents = (count + INDEX_INTERNAL_MAX_KEYS) / (INDEX_INTERNAL_MAX_KEYS + 1);
+    uint32_t* parent_pages = malloc(sizeof(uint32_t) * parents);
+    for (uint32_t i = 0; i < parents; i++) {
+      uint32_t start = bulk_part_start(count, parents, i);
+      uint32_t end = bulk_part_start(count, parents, i + 1);
+      parent_pages[i] = get_unused_page_num(pager);
+      void* node = get_page(pager, parent_pages[i]);
+      initialize_index_node(node, NODE_INTERNAL);
+      for (uint32_t child = start; child + 1 < end; child++) {
+        index_node_entries(node)[child - start] = max_entries[child];
+        index_node_children(node)[child - start] = pages[child];
+      }
+      *index_node_count(node) = end - start - 1;
+      *index_node_link(node) = pages[end - 1];
+      max_entries[i] = max_entries[end - 1];
+      pager_mark_dirty(pager, parent_pages[i]);
+      pager_unpin(pager, parent_pages[i]);
+    }
+    free(pages);
+    pages = parent_pages;
+    count = parents;
+  }
+
+  uint32_t root_page_num = pages[0];
+  void* root = get_page(pager, root_page_num);
+  set_node_root(root, true);
+  pager_unpin(pager, root_page_num);
+  free(pages);
+  free(max_entries);
+  return root_page_num;
+}
+
+uint32_t index_build_from_rows(Pager* pager, Row* rows, uint32_t num_rows,
+                               Column column) {
+  uint64_t* entries = malloc(INDEX_ENTRY_SIZE * (num_rows ? num_rows : 1));
+  for (uint32_t i = 0; i < num_rows; i++) {
+    entries[i] = index_entry(&rows[i], column);
+  }
+  qsort(entries, num_rows, INDEX_ENTRY_SIZE, compare_uint64);
+  uint32_t root_page_num = index_build(pager, entries, num_rows);
+  free(entries);
+  return root_page_num;
+}
+
+void index_collect_pages(Pager* pager, uint32_t page_num, uint32_t** pages,
+                         uint32_t* num_pages, uint32_t* capacity) {
+  if (*num_pages == *capacity) {
+    *capacity *= 2;
+    *pages = realloc(*pages, sizeof(uint32_t) * *capacity);
+  }
+  (*pages)[(*num_pages)++] = page_num;
+
+  void* node = get_page(pager, page_num);
+  if (get_node_type(node) == NODE_INTERNAL) {
+    for (uint32_t i = 0; i <= *index_node_count(node); i++) {
+      index_collect_pages(pager, index_node_child(node, i), pages, num_pages,
+                          capacity);
+    }
+  }
+  pager_unpin(pager, page_num);
+}
+
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+  Column column = statement->match_column;
+  if (table->index_roots[column] != 0) {
+    return EXECUTE_INDEX_EXISTS;
+  }
+
+  uint32_t capacity = 1024;
+  uint32_t num_entries = 0;
+  uint64_t* entries = malloc(INDEX_ENTRY_SIZE * capacity);
+  Cursor* cursor = table_start(table);
+  Row row;
+  while (!cursor->end_of_table) {
+    if (num_entries == capacity) {
+      capacity *= 2;
+      entries = realloc(entries, INDEX_ENTRY_SIZE * capacity);
+    }
+    cursor_value(cursor, &row);
+    entries[num_entries++] = index_entry(&row, column);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+
+  qsort(entries, num_entries, INDEX_ENTRY_SIZE, compare_uint64);
+  table_set_index_root(table, column, index_build(table->pager, entries, num_entries));
+  free(entries);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_table(const char* name, uint16_t* column_sizes,
+                                   Database* database) {
+  if (database_table(database, name) != NULL) {
+    return EXECUTE_TABLE_EXISTS;
+  }
+  if (database->num_tables == CATALOG_MAX_TABLES) {
+    return EXECUTE_CATALOG_FULL;
+  }
+  database_add_table(database, name, new_table_root(database->pager), NULL, column_sizes);
+  return EXECUTE_SUCCESS;
+}
+
+/* Whether the record's username or email is `value` */
+bool record_column_equals(void* record, void* dictionary, Column column,
+                          const char* value, uint32_t length) {
+  uint8_t* username = record + ID_SIZE;
+  if (column == COLUMN_USERNAME) {
+    return username[0] == length && memcmp(username + 1, value, length) == 0;
+  }
+  uint8_t* email = username + STRING_LENGTH_SIZE + username[0];
+  uint8_t* end = email + STRING_LENGTH_SIZE + email[0];
+  uint8_t* domain = NULL;
+  uint32_t domain_length = 0;
+  if (dictionary != NULL && *end != LEAF_DICTIONARY_NONE) {
+    domain = dictionary_entry(dictionary, *end);
+    domain_length = *domain++;
+  }
+  return email[0] + domain_length == length &&
+         memcmp(email + 1, value, email[0]) == 0 &&
+         (domain_length == 0 || memcmp(domain, value + email[0], domain_length) == 0);
+}
+
+/*
+Ids of the rows whose column equals the statement's value, in id order.
+With an index only the entries carrying the value's hash are read, and
+each of those rows is checked, since different values can share a hash;
+without one every row is compared.
+*/
+uint32_t* table_match_ids(Statement* statement, Table* table, uint32_t* num_ids) {
+  Pager* pager = table->pager;
+  Column column = statement->match_column;
+  const char* value = statement->match_value;
+  uint32_t length = strlen(value);
+  uint32_t capacity = 16;
+  uint32_t* ids = malloc(sizeof(uint32_t) * capacity);
+  *num_ids = 0;
+
+  if (table->index_roots[column] == 0) {
+    Cursor* cursor = table_start(table);
+    uint32_t page_num = cursor->page_num;
+    bool done = cursor->end_of_table;
+    ReadAhead readahead = cursor->readahead;
+    free(cursor);
+    while (!done) {
+      void* node = get_page(pager, page_num);
+      void* dictionary = leaf_node_dictionary(node);
+      for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+        if (record_column_equals(leaf_node_value(node, i), dictionary, column, value,
+                                 length)) {
+          if (*num_ids == capacity) {
+            capacity *= 2;
+            ids = realloc(ids, sizeof(uint32_t) * capacity);
+          }
+          ids[(*num_ids)++] = *leaf_node_key(node, i);
+        }
+      }
+      uint32_t next_page_num = *leaf_node_next_leaf(node);
+      pager_unpin(pager, page_num);
+      done = next_page_num == 0;
+      if (!done) {
+        readahead_advance(&readahead, pager);
+      }
+      page_num = next_page_num;
+    }
+    return ids;
+  }
+
+  uint32_t hash = index_hash(value);
+  uint64_t first = (uint64_t)hash << 32;
+  uint32_t page_num = table->index_roots[column];
+  void* node = get_page(pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_page_num = index_node_child(
+        node, index_search(index_node_entries(node), *index_node_count(node), first));
+    pager_unpin(pager, page_num);
+    page_num = child_page_num;
+    node = get_page(pager, page_num);
+  }
+
+  uint32_t position = index_search(index_node_entries(node), *index_node_count(node),
+                                   first);
+  while (true) {
+    if (position == *index_node_count(node)) {
+      uint32_t next_page_num = *index_node_link(node);
+      pager_unpin(pager, page_num);
+      if (next_page_num == 0) {
+        break;
+      }
+      page_num = next_page_num;
+      node = get_page(pager, page_num);
+      position = 0;
+      continue;
+    }
+    uint64_t entry = index_node_entries(node)[position++];
+    if (entry >> 32 != hash) {
+      pager_unpin(pager, page_num);
+      break;
+    }
+
+    uint32_t id = (uint32_t)entry;
+    Cursor* cursor = table_find(table, id);
+    void* leaf = get_page(pager, cursor->page_num);
+    if (cursor->cell_num < *leaf_node_num_cells(leaf) &&
+        *leaf_node_key(leaf, cursor->cell_num) == id &&
+        record_column_equals(leaf_node_value(leaf, cursor->cell_num),
+                             leaf_node_dictionary(leaf), column, value, length)) {
+      if (*num_ids == capacity) {
+        capacity *= 2;
+        ids = realloc(ids, sizeof(uint32_t) * capacity);
+      }
+      ids[(*num_ids)++] = id;
+    }
+    pager_unpin(pager, cursor->page_num);
+    free(cursor);
+  }
+  return ids;
+}
+
+ExecuteResult execute_insert_batch(Statement* statement, Table* table);
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  if (statement->num_rows_to_insert > 1) {
+    return execute_insert_batch(statement, table);
+  }
+
+  Row* row_to_insert = &(statement->row_to_insert);
+  uint32_t key_to_insert = row_to_insert->id;
+  Cursor* cursor = table_find(table, key_to_insert);
+
+  void* node = get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  bool duplicate = cursor->cell_num < num_cells &&
+                   *leaf_node_key(node, cursor->cell_num) == key_to_insert;
+  pager_unpin(table->pager, cursor->page_num);
+  if (duplicate) {
+    free(cursor);
+    return EXECUTE_DUPLICATE_KEY;
+  }
+
+  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+
+  free(cursor);
+
+  index_insert_rows(table, row_to_insert, 1);
+  return EXECUTE_SUCCESS;
+}
+
+void sink_init(ResultSink* sink, OutputMode mode, int file_descriptor) {
+  sink->mode = mode;
+  sink->file_descriptor = file_descriptor;
+  sink->buffer = malloc(SINK_BUFFER_SIZE);
+  sink->used = 0;
+  sink->capacity = SINK_BUFFER_SIZE;
+  sink->write_lock = NULL;
+}
+
+void sink_flush(ResultSink* sink) {
+  if (sink->file_descriptor == -1) {
+    return;  // the rows stay in memory until the sink's owner takes them
+  }
+  if (sink->write_lock) {
+    pthread_mutex_lock(sink->write_lock);
+  }
+  char* data = sink->buffer;
+  uint32_t remaining = sink->used;
+  while (remaining > 0) {
+    ssize_t bytes_written = write(sink->file_descriptor, data, remaining);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error writing result: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    data += bytes_written;
+    remaining -= bytes_written;
+  }
+  sink->used = 0;
+  if (sink->write_lock) {
+    pthread_mutex_unlock(sink->write_lock);
+  }
+}
+
+/* Moves the rows an in-memory sink holds to the end of another one */
+void sink_append(ResultSink* sink, ResultSink* rows) {
+  while (sink->capacity - sink->used < rows->used) {
+    sink->capacity *= 2;
+  }
+  sink->buffer = realloc(sink->buffer, sink->capacity);
+  memcpy(sink->buffer + sink->used, rows->buffer, rows->used);
+  sink->used += rows->used;
+  rows->used = 0;
+}
+
+/*
+Called before a statement writes rows, so that anything printf still holds
+(the prompt, earlier messages) reaches the terminal first
+*/
+void sink_begin(ResultSink* sink) {
+  if (sink->file_descriptor == STDOUT_FILENO) {
+    fflush(stdout);
+  }
+}
+
+char* sink_write_id(char* out, uint32_t id) {
+  char digits[10];
+  uint32_t length = 0;
+  do {
+    digits[length++] = '0' + id % 10;
+    id /= 10;
+  } while (id > 0);
+  while (length > 0) {
+    *out++ = digits[--length];
+  }
+  return out;
+}
+
+/*
+Copies a text column given in up to two pieces (an email's local part and
+its dictionary domain). CSV quotes a value holding a comma, quote or line
+break and doubles its quotes; TSV backslash-escapes tabs, line breaks and
+backslashes.
+*/
+char* sink_write_text(char* out, OutputMode mode, uint8_t* text, uint32_t length,
+                      uint8_t* suffix, uint32_t suffix_length) {
+  uint8_t* pieces[2] = {text, suffix};
+  uint32_t lengths[2] = {length, suffix_length};
+  bool quote = false;
+  if (mode == OUTPUT_CSV) {
+    for (uint32_t p = 0; p < 2 && !quote; p++) {
+      for (uint32_t i = 0; i < lengths[p]; i++) {
+        uint8_t c = pieces[p][i];
+        if (c == ',' || c == '"' || c == '\n' || c == '\r') {
+          quote = true;
+          break;
+        }
+      }
+    }
+  }
+  if (!quote && mode != OUTPUT_TSV) {
+    memcpy(out, text, length);
+    memcpy(out + length, suffix, suffix_length);
+    return out + length + suffix_length;
+  }
+
+  if (quote) {
+    *out++ = '"';
+  }
+  for (uint32_t p = 0; p < 2; p++) {
+    for (uint32_t i = 0; i < lengths[p]; i++) {
+      uint8_t c = pieces[p][i];
+      if (quote && c == '"') {
+        *out++ = '"';
+      } else if (mode == OUTPUT_TSV && (c == '\t' || c == '\n' || c == '\r' ||
+                                        c == '\\')) {
+        *out++ = '\\';
+        c = c == '\t' ? 't' : c == '\n' ? 'n' : c == '\r' ? 'r' : '\\';
+      }
+      *out++ = c;
+    }
+  }
+  if (quote) {
+    *out++ = '"';
+  }
+  return out;
+}
+
+/*
+Formats one record as it sits in the leaf, without decoding it into a Row.
+Binary output is the plain record layout: u32 id, then username and email
+each as a u8 length and that many bytes.
+*/
+void sink_write_record(ResultSink* sink, void* record, void* dictionary) {
+  if (sink->capacity - sink->used < SINK_MAX_ROW_SIZE) {
+    if (sink->file_descriptor == -1) {
+      sink->capacity *= 2;
+      sink->buffer = realloc(sink->buffer, sink->capacity);
+    } else {
+      sink_flush(sink);
+    }
+  }
+  char* out = sink->buffer + sink->used;
+
+  uint32_t id;
+  memcpy(&id, record, ID_SIZE);
+  uint8_t* username = record + ID_SIZE;
+  uint8_t* email = username + STRING_LENGTH_SIZE + username[0];
+  uint8_t* end = email + STRING_LENGTH_SIZE + email[0];
+  uint8_t* domain = end;  // an empty suffix unless the dictionary has one
+  uint32_t domain_length = 0;
+  if (dictionary != NULL && *end != LEAF_DICTIONARY_NONE) {
+    uint8_t* entry = dictionary_entry(dictionary, *end);
+    domain = entry + 1;
+    domain_length = entry[0];
+  }
+
+  switch (sink->mode) {
+    case (OUTPUT_TABLE):
+      *out++ = '(';
+      out = sink_write_id(out, id);
+      memcpy(out, ", ", 2);
+      out = sink_write_text(out + 2, OUTPUT_TABLE, username + 1, username[0], end, 0);
+      memcpy(out, ", ", 2);
+      out = sink_write_text(out + 2, OUTPUT_TABLE, email + 1, email[0], domain,
+                            domain_length);
+      *out++ = ')';
+      break;
+    case (OUTPUT_CSV):
+    case (OUTPUT_TSV):
+      out = sink_write_id(out, id);
+      *out++ = sink->mode == OUTPUT_CSV ? ',' : '\t';
+      out = sink_write_text(out, sink->mode, username + 1, username[0], end, 0);
+      *out++ = sink->mode == OUTPUT_CSV ? ',' : '\t';
+      out = sink_write_text(out, sink->mode, email + 1, email[0], domain,
+                            domain_length);
+      break;
+    case (OUTPUT_BINARY):
+      memcpy(out, record, end - (uint8_t*)record);
+      out += end - (uint8_t*)record;
+      out[-email[0] - 1] = email[0] + domain_length;
+      memcpy(out, domain, domain_length);
+      out += domain_length;
+      sink->used = out - sink->buffer;
+      return;
+  }
+  *out++ = '\n';
+  sink->used = out - sink->buffer;
+}
+
+/*
+Writes the rows with ids in [min_id, max_id], at most `limit` of them. The
+records are read a leaf at a time, so each leaf is fetched once rather
+than once per row.
+*/
+void scan_rows(Table* table, uint32_t min_id, uint32_t max_id, uint32_t limit,
+               ResultSink* sink) {
+  Cursor* cursor = min_id == 0 ? table_start(table) : table_seek(table, min_id);
+
+  uint32_t num_rows = 0;
+  bool done = false;
+  while (!(cursor->end_of_table) && !done) {
+    uint32_t page_num = cursor->page_num;
+    void* node = get_page(table->pager, page_num);
+    void* dictionary = leaf_node_dictionary(node);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (; cursor->cell_num < num_cells; cursor->cell_num++) {
+      void* record = leaf_node_value(node, cursor->cell_num);
+      uint32_t id;
+      memcpy(&id, record, ID_SIZE);
+      if (id > max_id || num_rows == limit) {
+        done = true;
+        break;
+      }
+      sink_write_record(sink, record, dictionary);
+      num_rows++;
+    }
+    pager_unpin(table->pager, page_num);
+    if (!done) {
+      /* Step from the last cell onto the next leaf */
+      cursor->cell_num = num_cells - 1;
+      cursor_advance(cursor);
+    }
+  }
+
+  free(cursor);
+}
+
+/*
+Appends the separator keys of the internal nodes down to `depth` levels
+below this one, in key order. A separator is the largest key of the child
+to its left.
+*/
+void scan_collect_keys(Pager* pager, uint32_t page_num, uint32_t depth,
+                       uint32_t** keys, uint32_t* num_keys, uint32_t* capacity) {
+  void* node = get_page(pager, page_num);
+  if (get_node_type(node) == NODE_LEAF) {
+    pager_unpin(pager, page_num);
+    return;
+  }
+  uint32_t count = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= count; i++) {
+    if (depth > 0) {
+      scan_collect_keys(pager, *internal_node_child(node, i), depth - 1, keys,
+                        num_keys, capacity);
+    }
+    if (i == count) {
+      break;
+    }
+    if (*num_keys == *capacity) {
+      *capacity = *capacity ? *capacity * 2 : 64;
+      *keys = realloc(*keys, sizeof(uint32_t) * *capacity);
+    }
+    (*keys)[(*num_keys)++] = internal_node_keys(node)[i];
+  }
+  pager_unpin(pager, page_num);
+}
+
+void* scan_worker_main(void* argument) {
+  ScanWorker* worker = argument;
+  scan_rows(worker->table, worker->min_id, worker->max_id, UINT32_MAX,
+            &worker->sink);
+  if (worker->sink.file_descriptor != -1) {
+    sink_flush(&worker->sink);
+  }
+  return NULL;
+}
+
+/*
+Splits [min_id, max_id] at internal node separators, going down the tree
+until there are enough of them, and scans each range on its own thread.
+Ordered workers keep their rows in memory and are written out in key order
+once all are done; unordered ones write each full buffer as they go.
+*/
+void execute_parallel_scan(Statement* statement, Table* table, ResultSink* sink) {
+  uint32_t threads = table->scan_threads;
+  uint32_t* keys = NULL;
+  uint32_t num_keys = 0;
+  uint32_t capacity = 0;
+  uint32_t previous = UINT32_MAX;
+  for (uint32_t depth = 0; num_keys + 1 < threads && num_keys != previous; depth++) {
+    previous = num_keys;
+    num_keys = 0;
+    scan_collect_keys(table->pager, table->root_page_num, depth, &keys, &num_keys,
+                      &capacity);
+  }
+
+  /* Only separators strictly inside the range split it */
+  uint32_t inside = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    if (keys[i] >= statement->min_id && keys[i] < statement->max_id) {
+      keys[inside++] = keys[i];
+    }
+  }
+
+  ScanWorker* workers = malloc(sizeof(ScanWorker) * threads);
+  uint32_t num_workers = 0;
+  uint32_t min_id = statement->min_id;
+  for (uint32_t i = 1; i < threads && inside > 0; i++) {
+    uint32_t split = keys[(uint64_t)i * inside / threads];
+    if (split < min_id) {
+      continue;  // several workers would land on the same separator
+    }
+    workers[num_workers].min_id = min_id;
+    workers[num_workers].max_id = split;
+    num_workers++;
+    min_id = split + 1;
+  }
+  workers[num_workers].min_id = min_id;
+  workers[num_workers].max_id = statement->max_id;
+  num_workers++;
+  free(keys);
+
+  /* Rows headed for memory are kept in order */
+  bool unordered = table->scan_unordered && sink->file_descriptor != -1;
+  pthread_mutex_t write_lock;
+  pthread_mutex_init(&write_lock, NULL);
+  table->pager->shared = true;
+  for (uint32_t i = 0; i < num_workers; i++) {
+    ScanWorker* worker = &workers[i];
+    worker->table = table;
+    sink_init(&worker->sink, sink->mode, unordered ? sink->file_descriptor : -1);
+    if (unordered) {
+      worker->sink.write_lock = &write_lock;
+    }
+    if (pthread_create(&worker->thread, NULL, scan_worker_main, worker) != 0) {
+      printf("Unable to start scan thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (uint32_t i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  table->pager->shared = false;
+  pthread_mutex_destroy(&write_lock);
+
+  for (uint32_t i = 0; i < num_workers; i++) {
+    ResultSink* worker_sink = &workers[i].sink;
+    if (sink->file_descriptor == -1) {
+      sink_append(sink, worker_sink);
+    } else if (worker_sink->file_descriptor == -1) {
+      worker_sink->file_descriptor = sink->file_descriptor;
+      sink_flush(worker_sink);
+    }
+    free(worker_sink->buffer);
+  }
+  free(workers);
+}
+
+/*
+count(*) or sum(id) of the rows with ids in [min_id, max_id], from the
+leaves' key arrays alone. A leaf that lies wholly inside the range adds its
+cell count without looking at a single key when counting.
+*/
+uint64_t aggregate_keys(Table* table, uint32_t min_id, uint32_t max_id, bool sum) {
+  Cursor* cursor = min_id == 0 ? table_start(table) : table_seek(table, min_id);
+  uint64_t total = 0;
+  uint32_t page_num = cursor->page_num;
+  uint32_t cell_num = cursor->cell_num;
+  bool done = cursor->end_of_table;
+  ReadAhead readahead = cursor->readahead;
+  free(cursor);
+
+  while (!done) {
+    void* node = get_page(table->pager, page_num);
+    uint32_t* keys = leaf_node_keys(node);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t end = num_cells;
+    if (max_id != UINT32_MAX && num_cells > 0 && keys[num_cells - 1] > max_id) {
+      end = key_search(keys, num_cells, max_id + 1);
+      done = true;
+    }
+    if (sum) {
+      for (uint32_t i = cell_num; i < end; i++) {
+        total += keys[i];
+      }
+    } else if (end > cell_num) {
+      total += end - cell_num;
+    }
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    pager_unpin(table->pager, page_num);
+    if (next_page_num == 0) {
+      done = true;
+    } else if (!done) {
+      readahead_advance(&readahead, table->pager);
+    }
+    page_num = next_page_num;
+    cell_num = 0;
+  }
+  return total;
+}
+
+/*
+Largest id that is at most `bound`. This goes down the tree like a lookup
+of `bound`; when the leaf it reaches holds only larger keys, the answer is
+the largest key of the nearest subtree left of the path.
+*/
+bool aggregate_max_below(Table* table, uint32_t bound, uint32_t* result) {
+  Pager* pager = table->pager;
+  uint32_t page_num = table->root_page_num;
+  bool has_left = false;
+  uint32_t left_max = 0;
+  void* node = get_page(pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, bound);
+    if (child_index > 0) {
+      /* The key of the child to the left is its subtree's max */
+      has_left = true;
+      left_max = *internal_node_key(node, child_index - 1);
+    }
+    uint32_t child_page_num = *internal_node_child(node, child_index);
+    pager_unpin(pager, page_num);
+    page_num = child_page_num;
+    node = get_page(pager, page_num);
+  }
+
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_num = bound == UINT32_MAX
+                          ? num_cells
+                          : key_search(leaf_node_keys(node), num_cells, bound + 1);
+  bool found = cell_num > 0;
+  if (found) {
+    *result = *leaf_node_key(node, cell_num - 1);
+  }
+  pager_unpin(pager, page_num);
+
+  if (!found && has_left) {
+    *result = left_max;
+    found = true;
+  }
+  return found;
+}
+
+/* An aggregate's one result row; min and max of no rows are NULL */
+void sink_write_aggregate(ResultSink* sink, uint64_t value, bool is_null) {
+  char* out = sink->buffer + sink->used;
+  switch (sink->mode) {
+    case (OUTPUT_TABLE):
+      out += is_null ? sprintf(out, "(NULL)\n")
+                     : sprintf(out, "(%llu)\n", (unsigned long long)value);
+      break;
+    case (OUTPUT_CSV):
+    case (OUTPUT_TSV):
+      out += is_null ? sprintf(out, "\n")
+                     : sprintf(out, "%llu\n", (unsigned long long)value);
+      break;
+    case (OUTPUT_BINARY):
+      if (!is_null) {
+        memcpy(out, &value, sizeof(value));
+        out += sizeof(value);
+      }
+      break;
+  }
+  sink->used = out - sink->buffer;
+}
+
+void execute_aggregate(Statement* statement, Table* table, ResultSink* sink) {
+  uint64_t value = 0;
+  bool is_null = false;
+  switch (statement->aggregate) {
+    case (AGGREGATE_COUNT):
+    case (AGGREGATE_SUM):
+      value = aggregate_keys(table, statement->min_id, statement->max_id,
+                             statement->aggregate == AGGREGATE_SUM);
+      break;
+    case (AGGREGATE_MIN): {
+      Cursor* cursor = table_seek(table, statement->min_id);
+      is_null = cursor->end_of_table;
+      if (!is_null) {
+        void* node = get_page(table->pager, cursor->page_num);
+        value = *leaf_node_key(node, cursor->cell_num);
+        pager_unpin(table->pager, cursor->page_num);
+        is_null = value > statement->max_id;
+      }
+      free(cursor);
+      break;
+    }
+    case (AGGREGATE_MAX): {
+      uint32_t max_id;
+      is_null = !aggregate_max_below(table, statement->max_id, &max_id) ||
+                max_id < statement->min_id;
+      value = max_id;
+      break;
+    }
+    case (AGGREGATE_NONE):
+      break;
+  }
+  if (statement->limit > 0) {
+    sink_write_aggregate(sink, value, is_null);
+  }
+}
+
+/* select ... where username = or email = */
+void execute_select_matching(Statement* statement, Table* table, ResultSink* sink) {
+  uint32_t num_ids;
+  uint32_t* ids = table_match_ids(statement, table, &num_ids);
+
+  if (statement->aggregate != AGGREGATE_NONE) {
+    uint64_t value = 0;
+    switch (statement->aggregate) {
+      case (AGGREGATE_COUNT):
+        value = num_ids;
+        break;
+      case (AGGREGATE_SUM):
+        for (uint32_t i = 0; i < num_ids; i++) {
+          value += ids[i];
+        }
+        break;
+      case (AGGREGATE_MIN):
+        value = num_ids > 0 ? ids[0] : 0;
+        break;
+      case (AGGREGATE_MAX):
+        value = num_ids > 0 ? ids[num_ids - 1] : 0;
+        break;
+      case (AGGREGATE_NONE):
+        break;
+    }
+    bool is_null = num_ids == 0 && (statement->aggregate == AGGREGATE_MIN ||
+                                    statement->aggregate == AGGREGATE_MAX);
+    if (statement->limit > 0) {
+      sink_write_aggregate(sink, value, is_null);
+    }
+    free(ids);
+    return;
+  }
+
+  for (uint32_t i = 0; i < num_ids && i < statement->limit; i++) {
+    Cursor* cursor = table_find(table, ids[i]);
+    void* node = get_page(table->pager, cursor->page_num);
+    sink_write_record(sink, leaf_node_value(node, cursor->cell_num),
+                      leaf_node_dictionary(node));
+    pager_unpin(table->pager, cursor->page_num);
+    free(cursor);
+  }
+  free(ids);
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table, ResultSink* sink) {
+  sink_begin(sink);
+  if (statement->match_column != COLUMN_ID) {
+    execute_select_matching(statement, table, sink);
+  } else if (statement->aggregate != AGGREGATE_NONE) {
+    execute_aggregate(statement, table, sink);
+  } else if (table->scan_threads > 1 && statement->limit == UINT32_MAX) {
+    /* A limit needs the rows in order, so only limitless scans go parallel */
+    execute_parallel_scan(statement, table, sink);
+  } else {
+    scan_rows(table, statement->min_id, statement->max_id, statement->limit, sink);
+  }
+  sink_flush(sink);
+
+  return EXECUTE_SUCCESS;
+}
+
+/*
+Start of part `part` when `total` items are spread as evenly as possible
+over `parts` parts
+*/
+uint32_t bulk_part_start(uint32_t total, uint32_t parts, uint32_t part) {
+  uint32_t remainder = total % parts;
+  return part * (total / parts) + (part < remainder ? part : remainder);
+}
+
+void leaf_plan_reset(LeafPlan* plan) {
+  plan->size = plan->compress ? LEAF_DICTIONARY_COUNT_SIZE : 0;
+  for (uint32_t i = 0; i < plan->num_claimed; i++) {
+    memset(&plan->domains[plan->claimed[i]], 0, sizeof(LeafDomain));
+  }
+  plan->num_claimed = 0;
+  plan->num_entries = 0;
+}
+
+void leaf_plan_init(LeafPlan* plan, bool compress) {
+  /* Room for twice the most rows a leaf can hold, so probes stay short */
+  uint32_t capacity = 64;
+  while (capacity < 2 * PAGE_SIZE / LEAF_NODE_SLOT_SIZE) {
+    capacity *= 2;
+  }
+  plan->compress = compress;
+  plan->domains = compress ? calloc(capacity, sizeof(LeafDomain)) : NULL;
+  plan->domain_capacity = capacity;
+  plan->claimed = compress ? malloc(sizeof(uint32_t) * capacity) : NULL;
+  plan->num_claimed = 0;
+  plan->entries =
+      compress ? malloc(sizeof(LeafDomain*) * LEAF_DICTIONARY_MAX_ENTRIES) : NULL;
+  leaf_plan_reset(plan);
+}
+
+void leaf_plan_free(LeafPlan* plan) {
+  free(plan->domains);
+  free(plan->claimed);
+  free(plan->entries);
+}
+
+/*
+The tracked domain of `row`, or its free slot if the leaf has not seen it
+yet. NULL when the row has no domain or the table is too full to track
+more, in which case the domain just stays inline.
+*/
+LeafDomain* leaf_plan_domain(LeafPlan* plan, Row* row) {
+  uint32_t length = email_domain_length(row->email);
+  if (length == 0) {
+    return NULL;
+  }
+  char* domain = row->email + strlen(row->email) - length;
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)domain[i]) * 16777619u;
+  }
+  uint32_t mask = plan->domain_capacity - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    LeafDomain* entry = &plan->domains[slot];
+    if (entry->domain == NULL) {
+      if (plan->num_claimed * 4 >= plan->domain_capacity * 3) {
+        return NULL;
+      }
+      plan->claimed[plan->num_claimed++] = slot;
+      entry->domain = domain;
+      entry->length = length;
+      entry->index = LEAF_DICTIONARY_NONE;
+      return entry;
+    }
+    if (entry->length == length && memcmp(entry->domain, domain, length) == 0) {
+      return entry;
+    }
+  }
+}
+
+/* Bytes `row` would add to the leaf */
+uint32_t leaf_plan_cost(LeafPlan* plan, Row* row) {
+  if (!plan->compress) {
+    return LEAF_NODE_SLOT_SIZE + row_size(row, false, LEAF_DICTIONARY_NONE);
+  }
+  /* Looking a domain up may claim its slot, which counts as unseen */
+  LeafDomain* domain = leaf_plan_domain(plan, row);
+  if (domain == NULL || domain->count == 0 ||
+      (domain->count == 1 && plan->num_entries == LEAF_DICTIONARY_MAX_ENTRIES)) {
+    return LEAF_NODE_SLOT_SIZE + row_size(row, true, LEAF_DICTIONARY_NONE);
+  }
+  if (domain->count == 1) {
+    /* Seen once: both rows drop the domain and it moves to the dictionary */
+    return LEAF_NODE_SLOT_SIZE + row_size(row, true, 0) +
+           LEAF_DICTIONARY_ENTRY_OFFSET_SIZE + STRING_LENGTH_SIZE;
+  }
+  return LEAF_NODE_SLOT_SIZE + row_size(row, true, domain->index);
+}
+
+void leaf_plan_add(LeafPlan* plan, Row* row) {
+  plan->size += leaf_plan_cost(plan, row);
+  if (!plan->compress) {
+    return;
+  }
+  LeafDomain* domain = leaf_plan_domain(plan, row);
+  if (domain == NULL) {
+    return;
+  }
+  if (domain->count == 1 && plan->num_entries < LEAF_DICTIONARY_MAX_ENTRIES) {
+    domain->index = plan->num_entries;
+    plan->entries[plan->num_entries++] = domain;
+  }
+  domain->count++;
+}
+
+/* Bytes rows [first, end) take in one leaf */
+uint32_t leaf_plan_measure(LeafPlan* plan, Row* rows, uint32_t first,
+                           uint32_t end) {
+  leaf_plan_reset(plan);
+  for (uint32_t i = first; i < end; i++) {
+    leaf_plan_add(plan, &rows[i]);
+  }
+  return plan->size;
+}
+
+/*
+Move the cut between two neighbouring leaves, rows [first, cut) and
+[cut, end), to where they come out as even as possible. A new cut is only
+taken if it makes the bigger side smaller, so both keep fitting.
+*/
+uint32_t leaf_balance_cut(LeafPlan* plan, Row* rows, uint32_t first,
+                          uint32_t cut, uint32_t end) {
+  uint32_t low = first + 1, high = end - 1;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (leaf_plan_measure(plan, rows, first, middle) >=
+        leaf_plan_measure(plan, rows, middle, end)) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+
+  uint32_t best = cut;
+  uint32_t best_left = leaf_plan_measure(plan, rows, first, cut);
+  uint32_t best_right = leaf_plan_measure(plan, rows, cut, end);
+  uint32_t best_size = best_left > best_right ? best_left : best_right;
+  for (uint32_t candidate = low - 1; candidate <= low; candidate++) {
+    if (candidate <= first || candidate >= end || candidate == cut) {
+      continue;
+    }
+    uint32_t left = leaf_plan_measure(plan, rows, first, candidate);
+    uint32_t right = leaf_plan_measure(plan, rows, candidate, end);
+    uint32_t size = left > right ? left : right;
+    if (size < best_size) {
+      best = candidate;
+      best_size = size;
+    }
+  }
+  return best;
+}
+
+/*
+Cut rows sorted by id into consecutive leaves of at most `capacity` bytes:
+packed greedily, which gives the fewest leaves, then with the rest shared
+evenly between the last two so neither is left nearly empty. Fills
+`starts` (num_rows + 1 entries at most) so leaf i holds rows
+[starts[i], starts[i + 1]) and returns the number of leaves, which is at
+least one.
+*/
+uint32_t leaf_partition(Row* rows, uint32_t num_rows, uint32_t capacity,
+                        LeafPlan* plan, uint32_t* starts) {
+  if (capacity < LEAF_NODE_MAX_CELL_SIZE + LEAF_DICTIONARY_COUNT_SIZE) {
+    capacity = LEAF_NODE_MAX_CELL_SIZE + LEAF_DICTIONARY_COUNT_SIZE;
+  }
+  uint32_t num_parts = 0;
+  starts[0] = 0;
+  leaf_plan_reset(plan);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if (i > 0 && plan->size + leaf_plan_cost(plan, &rows[i]) > capacity) {
+      starts[++num_parts] = i;
+      leaf_plan_reset(plan);
+    }
+    leaf_plan_add(plan, &rows[i]);
+  }
+  starts[++num_parts] = num_rows;
+
+  if (num_parts > 1) {
+    starts[num_parts - 1] =
+        leaf_balance_cut(plan, rows, starts[num_parts - 2],
+                         starts[num_parts - 1], num_rows);
+  }
+  return num_parts;
+}
+
+/*
+Fill an empty leaf with rows sorted by id. With compression, the domains
+that the plan put in the dictionary are written first, at the end of the
+page, and the records refer to them.
+*/
+void leaf_node_write_rows(void* node, Row* rows, uint32_t num_rows,
+                          LeafPlan* plan) {
+  leaf_plan_reset(plan);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    leaf_plan_add(plan, &rows[i]);
+  }
+
+  if (plan->compress) {
+    uint32_t size = LEAF_DICTIONARY_COUNT_SIZE +
+                    plan->num_entries * LEAF_DICTIONARY_ENTRY_OFFSET_SIZE;
+    for (uint32_t i = 0; i < plan->num_entries; i++) {
+      size += STRING_LENGTH_SIZE + plan->entries[i]->length;
+    }
+    *leaf_node_content_start(node) -= size;
+    *leaf_node_dictionary_offset(node) = *leaf_node_content_start(node);
+    void* dictionary = leaf_node_dictionary(node);
+    uint16_t* offsets = dictionary + LEAF_DICTIONARY_COUNT_SIZE;
+    *(uint8_t*)dictionary = plan->num_entries;
+    uint32_t offset = LEAF_DICTIONARY_COUNT_SIZE +
+                      plan->num_entries * LEAF_DICTIONARY_ENTRY_OFFSET_SIZE;
+    for (uint32_t i = 0; i < plan->num_entries; i++) {
+      offsets[i] = offset;
+      serialize_string(plan->entries[i]->domain, plan->entries[i]->length,
+                       dictionary + offset);
+      offset += STRING_LENGTH_SIZE + plan->entries[i]->length;
+    }
+  }
+
+  /* Appending one by one would move the offsets for every cell */
+  *leaf_node_num_cells(node) = num_rows;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    uint8_t domain = LEAF_DICTIONARY_NONE;
+    if (plan->compress) {
+      LeafDomain* entry = leaf_plan_domain(plan, &rows[i]);
+      domain = entry == NULL ? LEAF_DICTIONARY_NONE : entry->index;
+    }
+    *leaf_node_content_start(node) -= row_size(&rows[i], plan->compress, domain);
+    *leaf_node_key(node, i) = rows[i].id;
+    *leaf_node_offset(node, i) = *leaf_node_content_start(node);
+    serialize_row(&rows[i], plan->compress, domain, leaf_node_value(node, i));
+  }
+}
+
+int compare_row_id(const void* a, const void* b) {
+  return compare_uint32(&((const Row*)a)->id, &((const Row*)b)->id);
+}
+
+/*
+Append the page numbers of every node under `page_num` to `pages`
+*/
+void bulk_collect_pages(Pager* pager, uint32_t page_num, uint32_t** pages,
+                        uint32_t* num_pages, uint32_t* capacity) {
+  if (*num_pages == *capacity) {
+    *capacity *= 2;
+    *pages = realloc(*pages, sizeof(uint32_t) * *capacity);
+  }
+  (*pages)[(*num_pages)++] = page_num;
+
+  void* node = get_page(pager, page_num);
+  if (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t child = i < num_keys ? *internal_node_child(node, i)
+                                    : *internal_node_right_child(node);
+      bulk_collect_pages(pager, child, pages, num_pages, capacity);
+    }
+  }
+  pager_unpin(pager, page_num);
+}
+
+/*
+Build a B-tree over rows sorted by id, bottom-up. Leaves are packed to
+`fill_percent` of LEAF_NODE_SPACE_FOR_CELLS and internal nodes to full fan-out,
+with every level spread evenly so no node is left nearly empty. All page
+numbers are reserved first, so each node is written exactly once with its
+sibling link and high key already known, leaves first in key order.
+Returns the root page number.
+*/
+uint32_t bulk_build(Pager* pager, Row* rows, uint32_t num_rows, uint32_t fill_percent,
+                    bool compress) {
+  LeafPlan plan;
+  leaf_plan_init(&plan, compress);
+  uint32_t* leaf_starts = malloc(sizeof(uint32_t) * (num_rows + 1));
+  uint32_t max_children = INTERNAL_NODE_MAX_KEYS + 1;
+
+  uint32_t level_size[32];
+  uint32_t num_levels = 1;
+  // an empty table is still one root leaf
+  level_size[0] = leaf_partition(rows, num_rows,
+                                 LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100,
+                                 &plan, leaf_starts);
+  while (level_size[num_levels - 1] > 1) {
+    level_size[num_levels] = (level_size[num_levels - 1] + max_children - 1) / max_children;
+    num_levels++;
+  }
+
+  uint32_t* pages[32];
+  uint32_t* max_keys[32];
+  for (uint32_t level = 0; level < num_levels; level++) {
+    pages[level] = malloc(sizeof(uint32_t) * level_size[level]);
+    max_keys[level] = malloc(sizeof(uint32_t) * level_size[level]);
+    for (uint32_t j = 0; j < level_size[level]; j++) {
+      pages[level][j] = get_unused_page_num(pager);
+    }
+  }
+
+  for (uint32_t j = 0; j < level_size[0]; j++) {
+    uint32_t end = leaf_starts[j + 1];
+    max_keys[0][j] = end > 0 ? rows[end - 1].id : 0;
+  }
+  for (uint32_t level = 1; level < num_levels; level++) {
+    uint32_t num_children = level_size[level - 1];
+    for (uint32_t j = 0; j < level_size[level]; j++) {
+      uint32_t end = bulk_part_start(num_children, level_size[level], j + 1);
+      max_keys[level][j] = max_keys[level - 1][end - 1];
+    }
+  }
+
+  for (uint32_t j = 0; j < level_size[0]; j++) {
+    uint32_t first = leaf_starts[j];
+    uint32_t end = leaf_starts[j + 1];
+    uint32_t page_num = pages[0][j];
+    void* node = get_page(pager, page_num);
+    initialize_leaf_node(node);
+    set_node_root(node, num_levels == 1);
+    *leaf_node_next_leaf(node) = j + 1 < level_size[0] ? pages[0][j + 1] : 0;
+    *node_high_key(node) = max_keys[0][j];
+    leaf_node_write_rows(node, rows + first, end - first, &plan);
+    pager_mark_dirty(pager, page_num);
+    pager_unpin(pager, page_num);
+  }
+
+  for (uint32_t level = 1; level < num_levels; level++) {
+    uint32_t num_children = level_size[level - 1];
+    for (uint32_t j = 0; j < level_size[level]; j++) {
+      uint32_t first = bulk_part_start(num_children, level_size[level], j);
+      uint32_t end = bulk_part_start(num_children, level_size[level], j + 1);
+      uint32_t page_num = pages[level][j];
+      void* node = get_page(pager, page_num);
+      initialize_internal_node(node);
+      set_node_root(node, level == num_levels - 1);
+      *internal_node_num_keys(node) = end - first - 1;
+      for (uint32_t child = first; child < end - 1; child++) {
+        *internal_node_child(node, child - first) = pages[level - 1][child];
+        *internal_node_key(node, child - first) = max_keys[level - 1][child];
+      }
+      *internal_node_right_child(node) = pages[level - 1][end - 1];
+      *node_right_link(node) = j + 1 < level_size[level] ? pages[level][j + 1] : 0;
+      *node_high_key(node) = max_keys[level][j];
+      pager_mark_dirty(pager, page_num);
+      pager_unpin(pager, page_num);
+    }
+  }
+
+  uint32_t root_page_num = pages[num_levels - 1][0];
+  free(leaf_starts);
+  leaf_plan_free(&plan);
+  for (uint32_t level = 0; level < num_levels; level++) {
+    free(pages[level]);
+    free(max_keys[level]);
+  }
+  return root_page_num;
+}
+
+bool load_rows(Table* table, Row* rows, uint32_t num_rows, uint32_t fill_percent);
+
+/*
+Bulk import for `.load`: every line of the file is `id username email`.
+The rows are merged with the ones already in the table, sorted unless the
+input is already in order, and the whole tree is rebuilt bottom-up by
+bulk_build. The old tree's pages go to the freelist before the build, so
+the new tree reuses them. The rebuild runs as a single statement, so with a
+WAL it commits all at once.
+*/
+void execute_load(Table* table, const char* path, uint32_t fill_percent) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    printf("Unable to open '%s'\n", path);
+    return;
+  }
+
+  uint32_t capacity = 1024;
+  uint32_t num_rows = 0;
+  Row* rows = malloc(sizeof(Row) * capacity);
+  char* line = NULL;
+  size_t line_length = 0;
+  uint32_t line_num = 0;
+  PrepareResult parsed = PREPARE_SUCCESS;
+  while (getline(&line, &line_length, file) != -1) {
+    line_num++;
+    char* id_string = strtok(line, " \t\r\n");
+    if (id_string == NULL) {
+      continue;  // blank line
+    }
+    char* username = strtok(NULL, " \t\r\n");
+    char* email = strtok(NULL, " \t\r\n");
+    if (num_rows == capacity) {
+      capacity *= 2;
+      rows = realloc(rows, sizeof(Row) * capacity);
+    }
+    parsed = parse_row(id_string, username, email, &rows[num_rows]);
+    if (parsed == PREPARE_SUCCESS && !table_row_fits(table, &rows[num_rows])) {
+      parsed = PREPARE_STRING_TOO_LONG;
+    }
+    if (parsed != PREPARE_SUCCESS) {
+      break;
+    }
+    num_rows++;
+  }
+  free(line);
+  fclose(file);
+  if (parsed != PREPARE_SUCCESS) {
+    printf("Error on line %d of '%s': %s\n", line_num, path,
+           parsed == PREPARE_NEGATIVE_ID       ? "ID must be positive."
+           : parsed == PREPARE_STRING_TOO_LONG ? "String is too long."
+                                               : "Could not parse row.");
+    free(rows);
+    return;
+  }
+  if (load_rows(table, rows, num_rows, fill_percent)) {
+    printf("Loaded %d rows.\n", num_rows);
+  }
+}
+
+/*
+Adds `rows` (freed here) to the table and rebuilds it bottom-up with leaves
+`fill_percent` full, like .load. False if an id would be there twice.
+*/
+bool load_rows(Table* table, Row* rows, uint32_t num_rows, uint32_t fill_percent) {
+  Pager* pager = table->pager;
+  pthread_mutex_lock(&pager->lock);
+
+  /* Existing rows come out of the tree in order, the new ones follow */
+  uint32_t num_loaded = num_rows;
+  uint32_t capacity = num_rows + 1024;
+  Row* all_rows = malloc(sizeof(Row) * capacity);
+  uint32_t num_all = 0;
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    if (num_all + num_loaded >= capacity) {
+      capacity *= 2;
+      all_rows = realloc(all_rows, sizeof(Row) * capacity);
+    }
+    cursor_value(cursor, &all_rows[num_all++]);
+    cursor_advance(cursor);
+  }
+  free(cursor);
+  memcpy(all_rows + num_all, rows, sizeof(Row) * num_loaded);
+  num_all += num_loaded;
+  free(rows);
+
+  bool sorted = true;
+  for (uint32_t i = 1; i < num_all && sorted; i++) {
+    sorted = all_rows[i - 1].id < all_rows[i].id;
+  }
+  if (!sorted) {
+    qsort(all_rows, num_all, sizeof(Row), compare_row_id);
+  }
+  for (uint32_t i = 1; i < num_all; i++) {
+    if (all_rows[i - 1].id == all_rows[i].id) {
+      printf("Error: Duplicate key %d.\n", all_rows[i].id);
+      free(all_rows);
+      pager_end_statement(pager, false);
+      pthread_mutex_unlock(&pager->lock);
+      return false;
+    }
+  }
+
+  uint32_t num_old_pages = 0;
+  uint32_t old_capacity = 64;
+  uint32_t* old_pages = malloc(sizeof(uint32_t) * old_capacity);
+  bulk_collect_pages(pager, table->root_page_num, &old_pages, &num_old_pages,
+                     &old_capacity);
+  for (Column column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+    if (table->index_roots[column] != 0) {
+      index_collect_pages(pager, table->index_roots[column], &old_pages,
+                          &num_old_pages, &old_capacity);
+    }
+  }
+  for (uint32_t i = 0; i < num_old_pages; i++) {
+    pager_free_page(pager, old_pages[i]);
+  }
+  free(old_pages);
+
+  table->root_page_num = bulk_build(pager, all_rows, num_all, fill_percent,
+                                     table->compress_leaves);
+  table_save(table);
+  for (Column column = COLUMN_USERNAME; column < NUM_COLUMNS; column++) {
+    if (table->index_roots[column] != 0) {
+      table_set_index_root(table, column,
+                           index_build_from_rows(pager, all_rows, num_all, column));
+    }
+  }
+  free(all_rows);
+
+  pager_end_statement(pager, true);
+  pthread_mutex_unlock(&pager->lock);
+  return true;
+}
+
+/*
+Leaf a batch key belongs in, given the leaf the previous (smaller) key
+went to. Keys usually land in that leaf or the next one along the chain;
+only a key that skips past both costs a descent from the root, which
+replaces `path`. A path kept along the chain still leads to the parents.
+*/
+uint32_t batch_find_leaf(Table* table, TreePath* path, uint32_t leaf_page_num,
+                         uint32_t key) {
+  for (uint32_t step = 0; step < 2 && leaf_page_num != 0; step++) {
+    void* node = get_page(table->pager, leaf_page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    bool belongs = next_page_num == 0 ||
+                   (num_cells > 0 && key <= *leaf_node_key(node, num_cells - 1));
+    pager_unpin(table->pager, leaf_page_num);
+    if (belongs) {
+      return leaf_page_num;
+    }
+    leaf_page_num = next_page_num;
+  }
+
+  Cursor* cursor = table_find(table, key);
+  leaf_page_num = cursor->page_num;
+  *path = cursor->path;
+  free(cursor);
+  return leaf_page_num;
+}
+
+/*
+Merge a sorted run of new rows into one leaf. If the result does not fit,
+the leaf is split once into as many evenly filled leaves as it takes, and
+the new leaves are added to the parent one after the other, found through
+`path`. Returns the last leaf holding part of the run.
+*/
+uint32_t leaf_node_insert_run(Table* table, TreePath* path, uint32_t page_num,
+                              Row* rows, uint32_t num_rows) {
+  Pager* pager = table->pager;
+  void* node = get_page(pager, page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t total = num_cells + num_rows;
+
+  /*
+  The leaf is rewritten from scratch (with a fresh dictionary when
+  compressed), so decode its rows and merge the new ones in by key.
+  */
+  Row* merged = malloc(sizeof(Row) * total);
+  uint32_t* starts = malloc(sizeof(uint32_t) * (total + 1));
+  void* dictionary = leaf_node_dictionary(node);
+  uint32_t old_index = 0, new_index = 0;
+  for (uint32_t i = 0; i < total; i++) {
+    if (new_index == num_rows ||
+        (old_index < num_cells &&
+         *leaf_node_key(node, old_index) < rows[new_index].id)) {
+      deserialize_row(leaf_node_value(node, old_index++), dictionary, &merged[i]);
+    } else {
+      merged[i] = rows[new_index++];
+    }
+  }
+
+  LeafPlan plan;
+  leaf_plan_init(&plan, table->compress_leaves);
+  uint32_t num_parts =
+      leaf_partition(merged, total, LEAF_NODE_SPACE_FOR_CELLS, &plan, starts);
+  uint32_t old_next = *leaf_node_next_leaf(node);
+  uint32_t old_high_key = *node_high_key(node);
+  bool is_root = is_node_root(node);
+
+  uint32_t* part_pages = malloc(sizeof(uint32_t) * num_parts);
+  part_pages[0] = page_num;
+  for (uint32_t part = 1; part < num_parts; part++) {
+    part_pages[part] = get_unused_page_num(pager);
+  }
+  /*
+  Right to left, so each new leaf is complete before anything links to it
+  and the old leaf, the only one reachable so far, changes last
+  */
+  for (uint32_t part = num_parts; part-- > 0;) {
+    void* part_node = get_page(pager, part_pages[part]);
+    initialize_leaf_node(part_node);
+    set_node_root(part_node, part == 0 && is_root);
+    leaf_node_write_rows(part_node, merged + starts[part],
+                         starts[part + 1] - starts[part], &plan);
+    bool last = part + 1 == num_parts;
+    *leaf_node_next_leaf(part_node) = last ? old_next : part_pages[part + 1];
+    *node_high_key(part_node) = last ? old_high_key : merged[starts[part + 1] - 1].id;
+    pager_mark_dirty(pager, part_pages[part]);
+    pager_unpin(pager, part_pages[part]);
+  }
+  leaf_plan_free(&plan);
+
+  /*
+  Add the new leaves left to right, each as the upper half of a split of
+  the leaf before it. path->depth is read every time since a root split
+  makes the tree taller.
+  */
+  for (uint32_t part = 1; part < num_parts; part++) {
+    uint32_t separator = merged[starts[part] - 1].id;
+    btree_insert_split(table, path, path->depth, separator, part_pages[part]);
+  }
+  free(merged);
+  free(starts);
+  pager_unpin(pager, page_num);
+
+  uint32_t last_page_num = part_pages[num_parts - 1];
+  free(part_pages);
+  return last_page_num;
+}
+
+/*
+Insert several rows with one statement. The rows are sorted by key and
+checked for duplicates first, so a rejected batch changes nothing. Then
+each run of keys that belongs to the same leaf is merged into it at once,
+and the walk moves along the leaf chain instead of descending from the
+root for every row.
+*/
+ExecuteResult execute_insert_batch(Statement* statement, Table* table) {
+  Row* rows = statement->rows_to_insert;
+  uint32_t num_rows = statement->num_rows_to_insert;
+  qsort(rows, num_rows, sizeof(Row), compare_row_id);
+
+  TreePath path = {.depth = 0};
+  uint32_t leaf_page_num = 0;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if (i > 0 && rows[i - 1].id == rows[i].id) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+    leaf_page_num = batch_find_leaf(table, &path, leaf_page_num, rows[i].id);
+    void* node = get_page(table->pager, leaf_page_num);
+    uint32_t cell_num = leaf_node_find_cell(node, rows[i].id);
+    bool duplicate = cell_num < *leaf_node_num_cells(node) &&
+                     *leaf_node_key(node, cell_num) == rows[i].id;
+    pager_unpin(table->pager, leaf_page_num);
+    if (duplicate) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+
+  leaf_page_num = 0;
+  uint32_t i = 0;
+  while (i < num_rows) {
+    leaf_page_num = batch_find_leaf(table, &path, leaf_page_num, rows[i].id);
+    void* node = get_page(table->pager, leaf_page_num);
+    uint32_t run_end = num_rows;
+    if (*leaf_node_next_leaf(node) != 0) {
+      uint32_t max_key = *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+      run_end = i + 1;
+      while (run_end < num_rows && rows[run_end].id <= max_key) {
+        run_end++;
+      }
+    }
+    pager_unpin(table->pager, leaf_page_num);
+
+    leaf_page_num =
+        leaf_node_insert_run(table, &path, leaf_page_num, rows + i, run_end - i);
+    i = run_end;
+  }
+
+  index_insert_rows(table, rows, num_rows);
+  return EXECUTE_SUCCESS;
+}
+
+/* Runs the statement's program, stopping at the first error */
+ExecuteResult execute_program(Statement* statement, Table* table, Database* database,
+                              ResultSink* sink) {
+  Program* program = statement->program;
+  Value registers[PROGRAM_NUM_REGISTERS];
+  ExecuteResult result = EXECUTE_SUCCESS;
+
+  statement->match_column = COLUMN_ID;
+  for (uint32_t pc = 0; pc < program->num_instructions && result == EXECUTE_SUCCESS;
+       pc++) {
+    Instruction* instruction = &program->instructions[pc];
+    Value* r = &registers[instruction->p1];
+    switch (instruction->opcode) {
+      case (OP_INTEGER):
+        r->integer = instruction->p3;
+        break;
+      case (OP_STRING):
+        r->text = program->strings + instruction->p3;
+        break;
+      case (OP_VARIABLE):
+        *r = statement->parameters[instruction->p2];
+        break;
+      case (OP_ROW): {
+        Row* row = &statement->rows_to_insert[statement->num_rows_to_insert++];
+        row->id = r[0].integer;
+        strcpy(row->username, r[1].text);
+        strcpy(row->email, r[2].text);
+        if (!table_row_fits(table, row)) {
+          result = EXECUTE_STRING_TOO_LONG;
+        }
+        break;
+      }
+      case (OP_INSERT):
+        result = execute_insert(statement, table);
+        break;
+      case (OP_MATCH):
+        statement->match_column = instruction->p2;
+        strcpy(statement->match_value, r->text);
+        break;
+      case (OP_SELECT):
+        statement->min_id = r[0].integer;
+        statement->max_id = r[1].integer;
+        statement->limit = r[2].integer;
+        statement->aggregate = instruction->p2;
+        result = execute_select(statement, table, sink);
+        break;
+      case (OP_CREATE_INDEX):
+        statement->match_column = instruction->p2;
+        result = execute_create_index(statement, table);
+        break;
+      case (OP_CREATE_TABLE): {
+        uint16_t column_sizes[NUM_COLUMNS] = {ID_SIZE, instruction->p2, instruction->p3};
+        result = execute_create_table(program->table_name, column_sizes, database);
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+ExecuteResult execute_statement(Statement* statement, Database* database,
+                                ResultSink* sink) {
+  pthread_mutex_lock(&database->pager->lock);
+  Table* table = database_table(database, statement->program->table_name);
+  if (table == NULL && statement->type != STATEMENT_CREATE_TABLE) {
+    pthread_mutex_unlock(&database->pager->lock);
+    return EXECUTE_NO_SUCH_TABLE;
+  }
+
+  ExecuteResult result = execute_program(statement, table, database, sink);
+  pager_end_statement(database->pager, statement->type != STATEMENT_SELECT &&
+                                           result == EXECUTE_SUCCESS);
+  pthread_mutex_unlock(&database->pager->lock);
+  return result;
+}
+
+/*
+Runs a select against a snapshot instead of under pager->lock, which is
+only taken long enough to open it, so the writer goes on meanwhile. The
+reader only ever holds one page of the tree at a time apart from the
+cursor's leaf, and the pages it sees never change under it, so there is no
+latch to couple on the way down. The table handle is copied as it was at
+the snapshot, and its scan runs on this thread alone.
+*/
+ExecuteResult execute_snapshot_select(Statement* statement, Database* database,
+                                      ResultSink* sink) {
+  Pager* pager = database->pager;
+  if (pager->mode == PAGER_MMAP) {
+    return execute_statement(statement, database, sink);
+  }
+
+  Snapshot snapshot;
+  Table table;
+  pthread_mutex_lock(&pager->lock);
+  Table* current = database_table(database, statement->program->table_name);
+  if (current != NULL) {
+    table = *current;
+    pager_begin_snapshot(pager, &snapshot);
+  }
+  pthread_mutex_unlock(&pager->lock);
+  if (current == NULL) {
+    return EXECUTE_NO_SUCH_TABLE;
+  }
+
+  table.scan_threads = 1;
+  thread_snapshot = &snapshot;
+  ExecuteResult result = execute_program(statement, &table, database, sink);
+  thread_snapshot = NULL;
+  pager_end_snapshot(pager, &snapshot);
+  return result;
+}
+
+const char* prepare_result_message(PrepareResult result) {
+  switch (result) {
+    case (PREPARE_NEGATIVE_ID):
+      return "ID must be positive.";
+    case (PREPARE_STRING_TOO_LONG):
+      return "String is too long.";
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+      return "Unrecognized keyword at start of statement.";
+    default:
+      return "Syntax error. Could not parse statement.";
+  }
+}
+
+const char* execute_result_message(ExecuteResult result) {
+  switch (result) {
+    case (EXECUTE_DUPLICATE_KEY):
+      return "Error: Duplicate key.";
+    case (EXECUTE_INDEX_EXISTS):
+      return "Error: Index already exists.";
+    case (EXECUTE_NO_SUCH_TABLE):
+      return "Error: No such table.";
+    case (EXECUTE_TABLE_EXISTS):
+      return "Error: Table already exists.";
+    case (EXECUTE_CATALOG_FULL):
+      return "Error: Catalog is full.";
+    case (EXECUTE_STRING_TOO_LONG):
+      return "Error: String is too long for the table.";
+    default:
+      return "Executed.";
+  }
+}
+
+volatile sig_atomic_t server_stopping = 0;
+
+void server_stop(int signal_number) {
+  (void)signal_number;
+  server_stopping = 1;
+}
+
+/* Queues a response for the session */
+void session_respond(Session* session, ResponseStatus status, const char* data,
+                     uint32_t length) {
+  size_t needed = session->output_used + RESPONSE_HEADER_SIZE + length;
+  if (needed > session->output_capacity) {
+    while (session->output_capacity < needed) {
+      session->output_capacity *= 2;
+    }
+    session->output = realloc(session->output, session->output_capacity);
   }
+  char* out = session->output + session->output_used;
+  out[0] = status;
+  memcpy(out + 1, &length, sizeof(length));
+  memcpy(out + RESPONSE_HEADER_SIZE, data, length);
+  session->output_used = needed;
+}
 
-  /* Left child has data copied from old root */
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
+/*
+Runs one request, against a snapshot if it is a select and `snapshot` is
+set. The response is left in the sink, or is an error message.
+*/
+ResponseStatus execute_request(Database* database, InputBuffer* request,
+                               ResultSink* sink, bool snapshot,
+                               const char** response, uint32_t* length) {
+  Statement statement;
+  PrepareResult prepared = prepare_statement(request, &statement);
+  if (prepared != PREPARE_SUCCESS) {
+    *response = prepare_result_message(prepared);
+    *length = strlen(*response);
+    return RESPONSE_ERROR;
+  }
 
-  if (get_node_type(left_child) == NODE_INTERNAL) {
-    void* child;
-    for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-      child = get_page(table->pager, *internal_node_child(left_child,i));
-      *node_parent(child) = left_child_page_num;
-    }
-    child = get_page(table->pager, *internal_node_right_child(left_child));
-    *node_parent(child) = left_child_page_num;
+  sink->used = 0;
+  ExecuteResult result = snapshot && statement.type == STATEMENT_SELECT
+                             ? execute_snapshot_select(&statement, database, sink)
+                             : execute_statement(&statement, database, sink);
+  close_statement(&statement);
+  if (result != EXECUTE_SUCCESS) {
+    *response = execute_result_message(result);
+    *length = strlen(*response);
+    return RESPONSE_ERROR;
   }
+  *response = sink->buffer;
+  *length = sink->used;
+  return RESPONSE_OK;
+}
 
-  /* Root node is a new internal node with one key and two children */
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+/* Runs one request and queues its response */
+void session_execute(Session* session, Database* database, InputBuffer* request,
+                     ResultSink* sink) {
+  const char* response;
+  uint32_t length;
+  ResponseStatus status =
+      execute_request(database, request, sink, false, &response, &length);
+  session_respond(session, status, response, length);
 }
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num);
+void* reader_main(void* argument) {
+  ReaderPool* pool = argument;
+  InputBuffer* request = new_input_buffer();
+  ResultSink sink;
+  sink_init(&sink, OUTPUT_BINARY, -1);
 
-void internal_node_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
-  /*
-  Add a new child/key pair to parent that corresponds to child
-  */
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (pool->queue == NULL && !pool->stopping) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    ReadJob* job = pool->queue;
+    if (job == NULL) {
+      break;
+    }
+    pool->queue = job->next;
+    pthread_mutex_unlock(&pool->lock);
 
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(table->pager, child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
+    if (request->buffer_length < job->length + 1) {
+      request->buffer_length = job->length + 1;
+      request->buffer = realloc(request->buffer, request->buffer_length);
+    }
+    memcpy(request->buffer, job->text, job->length);
+    request->buffer[job->length] = '\0';
+    request->input_length = job->length;
+    const char* response;
+    job->status = execute_request(pool->database, request, &sink, true, &response,
+                                  &job->response_length);
+    job->response = malloc(job->response_length);
+    memcpy(job->response, response, job->response_length);
+
+    pthread_mutex_lock(&pool->lock);
+    job->next = pool->done;
+    pool->done = job;
+    uint64_t one = 1;
+    if (write(pool->done_event, &one, sizeof(one)) == -1) {
+      printf("Error signalling the server: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
 
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
+  for (uint32_t i = 0; i < STATEMENT_CACHE_SIZE; i++) {
+    if (statement_cache.programs[i] != NULL) {
+      free_program(statement_cache.programs[i]);
+    }
+  }
+  close_input_buffer(request);
+  free(sink.buffer);
+  return NULL;
+}
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_KEYS) {
-    internal_node_split_and_insert(table, parent_page_num, child_page_num);
-    return;
+void reader_pool_start(ReaderPool* pool, Database* database, uint32_t num_threads) {
+  pool->database = database;
+  pool->num_threads = num_threads;
+  pool->threads = malloc(sizeof(pthread_t) * num_threads);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->queue = NULL;
+  pool->queue_tail = NULL;
+  pool->done = NULL;
+  pool->done_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pool->stopping = false;
+  for (uint32_t i = 0; i < num_threads; i++) {
+    pthread_create(&pool->threads[i], NULL, reader_main, pool);
   }
+}
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  /*
-  An internal node with a right child of INVALID_PAGE_NUM is empty
-  */
-  if (right_child_page_num == INVALID_PAGE_NUM) {
-    *internal_node_right_child(parent) = child_page_num;
-    return;
+/* Lets the readers finish what is queued, then frees the responses left over */
+void reader_pool_stop(ReaderPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
   }
+  while (pool->done) {
+    ReadJob* job = pool->done;
+    pool->done = job->next;
+    free(job->text);
+    free(job->response);
+    free(job);
+  }
+  close(pool->done_event);
+  free(pool->threads);
+}
 
-  void* right_child = get_page(table->pager, right_child_page_num);
-  /*
-  If we are already at the max number of cells for a node, we cannot increment
-  before splitting. Incrementing without inserting a new key/child pair
-  and immediately calling internal_node_split_and_insert has the effect
-  of creating a new key at (max_cells + 1) with an uninitialized value
-  */
-  *internal_node_num_keys(parent) = original_num_keys + 1;
-
-  if (child_max_key > get_node_max_key(table->pager, right_child)) {
-    /* Replace right child */
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(table->pager, right_child);
-    *internal_node_right_child(parent) = child_page_num;
+void reader_pool_submit(ReaderPool* pool, Session* session, const char* text,
+                        uint32_t length) {
+  ReadJob* job = malloc(sizeof(ReadJob));
+  job->session = session;
+  job->text = malloc(length);
+  memcpy(job->text, text, length);
+  job->length = length;
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->queue == NULL) {
+    pool->queue = job;
   } else {
-    /* Make room for the new cell */
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* destination = internal_node_cell(parent, i);
-      void* source = internal_node_cell(parent, i - 1);
-      memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+    pool->queue_tail->next = job;
+  }
+  pool->queue_tail = job;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+Runs the complete requests the session has buffered, up to the first
+select when there are reader threads: that one goes to them, and the
+rest wait until its response is back. False if a request is too large.
+*/
+bool session_run(Session* session, Database* database, InputBuffer* request,
+                 ResultSink* sink, ReaderPool* readers) {
+  uint32_t consumed = 0;
+  while (!session->busy && session->input_used - consumed >= REQUEST_HEADER_SIZE) {
+    uint32_t length;
+    memcpy(&length, session->input + consumed, sizeof(length));
+    if (length > SERVER_MAX_REQUEST_SIZE) {
+      return false;
+    }
+    if (session->input_used - consumed - REQUEST_HEADER_SIZE < length) {
+      break;  // the rest of it has not arrived yet
+    }
+    char* text = session->input + consumed + REQUEST_HEADER_SIZE;
+    consumed += REQUEST_HEADER_SIZE + length;
+    if (readers != NULL && length >= 6 && strncmp(text, "select", 6) == 0) {
+      reader_pool_submit(readers, session, text, length);
+      session->busy = true;
+      break;
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
+    if (request->buffer_length < length + 1) {
+      request->buffer_length = length + 1;
+      request->buffer = realloc(request->buffer, request->buffer_length);
+    }
+    memcpy(request->buffer, text, length);
+    request->buffer[length] = '\0';
+    request->input_length = length;
+    session_execute(session, database, request, sink);
   }
+  memmove(session->input, session->input + consumed, session->input_used - consumed);
+  session->input_used -= consumed;
+  return true;
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+/*
+Reads what the client has sent and runs the complete requests in it.
+False once the client has hung up or sent a request that is too large.
+*/
+bool session_read(Session* session, Database* database, InputBuffer* request,
+                  ResultSink* sink, ReaderPool* readers) {
+  if (session->input_capacity - session->input_used < SERVER_READ_SIZE) {
+    session->input_capacity = session->input_used + SERVER_READ_SIZE;
+    session->input = realloc(session->input, session->input_capacity);
+  }
+  ssize_t bytes_read = read(session->file_descriptor,
+                            session->input + session->input_used,
+                            session->input_capacity - session->input_used);
+  if (bytes_read == 0) {
+    return false;
+  }
+  if (bytes_read == -1) {
+    return errno == EAGAIN || errno == EINTR;
+  }
+  session->input_used += bytes_read;
+  return session_run(session, database, request, sink, readers);
 }
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
-                          uint32_t child_page_num) {
-  uint32_t old_page_num = parent_page_num;
-  void* old_node = get_page(table->pager,parent_page_num);
-  uint32_t old_max = get_node_max_key(table->pager, old_node);
+/*
+Sends as much of the committed responses as the socket takes; false if it
+is broken
+*/
+bool session_send(Session* session) {
+  while (session->output_sent < session->output_committed) {
+    ssize_t bytes_sent =
+        send(session->file_descriptor, session->output + session->output_sent,
+             session->output_committed - session->output_sent, MSG_NOSIGNAL);
+    if (bytes_sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN;
+    }
+    session->output_sent += bytes_sent;
+  }
+  if (session->output_committed < session->output_used) {
+    return true;  // the rest waits for the next commit
+  }
+  session->output_used = 0;
+  session->output_sent = 0;
+  session->output_committed = 0;
+  if (session->output_capacity > SINK_BUFFER_SIZE) {
+    /* Give back the room a large result needed */
+    session->output_capacity = SERVER_READ_SIZE;
+    session->output = realloc(session->output, session->output_capacity);
+  }
+  return true;
+}
 
-  void* child = get_page(table->pager, child_page_num); 
-  uint32_t child_max = get_node_max_key(table->pager, child);
+void session_close(Session* session, Session** sessions) {
+  if (session->previous) {
+    session->previous->next = session->next;
+  } else {
+    *sessions = session->next;
+  }
+  if (session->next) {
+    session->next->previous = session->previous;
+  }
+  close(session->file_descriptor);
+  free(session->input);
+  free(session->output);
+  free(session);
+}
 
-  uint32_t new_page_num = get_unused_page_num(table->pager);
+/* Closes the session, or once its select is back if a reader is running it */
+void session_drop(Session* session, int epoll, Session** sessions) {
+  if (session->busy) {
+    session->closing = true;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, session->file_descriptor, NULL);
+  } else {
+    session_close(session, sessions);
+  }
+}
 
-  /*
-  Declaring a flag before updating pointers which
-  records whether this operation involves splitting the root -
-  if it does, we will insert our newly created node during
-  the step where the table's new root is created. If it does
-  not, we have to insert the newly created node into its parent
-  after the old node's keys have been transferred over. We are not
-  able to do this if the newly created node's parent is not a newly
-  initialized root node, because in that case its parent may have existing
-  keys aside from our old node which we are splitting. If that is true, we
-  need to find a place for our newly created node in its parent, and we
-  cannot insert it at the correct index if it does not yet have any keys
-  */
-  uint32_t splitting_root = is_node_root(old_node);
+/*
+Watch for room to send while responses are queued, otherwise for requests,
+and for nothing while the session waits on a reader
+*/
+void session_watch(Session* session, int epoll) {
+  uint32_t wanted = session->output_sent < session->output_committed ? EPOLLOUT
+                    : session->busy                                   ? 0
+                                                                      : EPOLLIN;
+  if (wanted != session->events) {
+    struct epoll_event change = {.events = wanted, .data.ptr = session};
+    epoll_ctl(epoll, EPOLL_CTL_MOD, session->file_descriptor, &change);
+    session->events = wanted;
+  }
+}
 
-  void* parent;
-  void* new_node;
-  if (splitting_root) {
-    create_new_root(table, new_page_num);
-    parent = get_page(table->pager,table->root_page_num);
-    /*
-    If we are splitting the root, we need to update old_node to point
-    to the new root's left child, new_page_num will already point to
-    the new root's right child
-    */
-    old_page_num = *internal_node_child(parent,0);
-    old_node = get_page(table->pager, old_page_num);
-  } else {
-    parent = get_page(table->pager,*node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
-    initialize_internal_node(new_node);
+/*
+Queue the responses the readers have finished, then go on with the
+requests their sessions held back
+*/
+void server_finish_reads(ReaderPool* readers, int epoll, Session** sessions,
+                         Database* database, InputBuffer* request, ResultSink* sink) {
+  uint64_t count;
+  if (read(readers->done_event, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    printf("Error waiting for readers: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_lock(&readers->lock);
+  ReadJob* jobs = readers->done;
+  readers->done = NULL;
+  pthread_mutex_unlock(&readers->lock);
+
+  while (jobs) {
+    ReadJob* job = jobs;
+    jobs = job->next;
+    Session* session = job->session;
+    session->busy = false;
+    if (session->closing) {
+      session_close(session, sessions);
+    } else {
+      session_respond(session, job->status, job->response, job->response_length);
+      if (session_run(session, database, request, sink, readers) &&
+          session_send(session)) {
+        session_watch(session, epoll);
+      } else {
+        session_drop(session, epoll, sessions);
+      }
+    }
+    free(job->text);
+    free(job->response);
+    free(job);
   }
-  
-  uint32_t* old_num_keys = internal_node_num_keys(old_node);
+}
 
-  uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void* cur = get_page(table->pager, cur_page_num);
+/*
+Commits the group the requests so far left open, then lets their responses
+go. Runs before the server waits again, so the statements of one wakeup
+share an fsync and none of them is acknowledged before it.
+*/
+void server_commit(Database* database, int epoll, Session** sessions) {
+  pager_commit(database->pager);
+  Session* session = *sessions;
+  while (session) {
+    Session* next = session->next;
+    if (!session->closing && session->output_committed < session->output_used) {
+      session->output_committed = session->output_used;
+      if (session_send(session)) {
+        session_watch(session, epoll);
+      } else {
+        session_drop(session, epoll, sessions);
+      }
+    }
+    session = next;
+  }
+}
 
-  /*
-  First put right child into new node and set right child of old node to invalid page number
-  */
-  internal_node_insert(table, new_page_num, cur_page_num);
-  *node_parent(cur) = new_page_num;
-  *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
-  /*
-  For each key until you get to the middle key, move the key and the child to the new node
-  */
-  for (int i = INTERNAL_NODE_MAX_KEYS - 1; i > INTERNAL_NODE_MAX_KEYS / 2; i--) {
-    cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+void server_accept(int listener, int epoll, Session** sessions) {
+  while (true) {
+    int client = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client == -1) {
+      return;  // none left, or the client gave up already
+    }
+    Session* session = calloc(1, sizeof(Session));
+    session->file_descriptor = client;
+    session->events = EPOLLIN;
+    session->output_capacity = SERVER_READ_SIZE;
+    session->output = malloc(session->output_capacity);
+    session->next = *sessions;
+    if (*sessions) {
+      (*sessions)->previous = session;
+    }
+    *sessions = session;
 
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = session};
+    epoll_ctl(epoll, EPOLL_CTL_ADD, client, &event);
+  }
+}
 
-    (*old_num_keys)--;
+/*
+Serves statements over a Unix socket until SIGINT or SIGTERM. One thread
+runs every statement in the order the requests arrive, against the one
+database and its buffer pool, and epoll tells it which clients have sent
+something or can take more of their responses. A client with responses
+still queued is not read from until they have gone out.
+
+With `num_readers` reader threads, selects go to them instead and run
+against snapshots, concurrently with each other and with the inserts the
+event loop thread goes on running. Each client's requests still run one
+at a time, in order.
+*/
+void serve(Database* database, const char* socket_path, uint32_t num_readers) {
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    printf("Socket path is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(address.sun_path, socket_path);
+  unlink(socket_path);  // left behind by an earlier server
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1 ||
+      bind(listener, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+      listen(listener, SOMAXCONN) == -1) {
+    printf("Unable to listen on '%s': %d\n", socket_path, errno);
+    exit(EXIT_FAILURE);
   }
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event);
 
   /*
-  Set child before middle key, which is now the highest key, to be node's right child,
-  and decrement number of keys
+  Without SA_RESTART, so that a signal interrupts epoll_pwait. Outside it
+  they are blocked, so one that comes while requests run is taken as soon
+  as the server waits again instead of being missed by it.
   */
-  *internal_node_right_child(old_node) = *internal_node_child(old_node,*old_num_keys - 1);
-  (*old_num_keys)--;
+  struct sigaction action = {0};
+  action.sa_handler = server_stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigset_t stop_signals, wait_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+  ReaderPool pool;
+  ReaderPool* readers = NULL;
+  if (num_readers > 0) {
+    readers = &pool;
+    reader_pool_start(readers, database, num_readers);
+    struct epoll_event done = {.events = EPOLLIN, .data.ptr = readers};
+    epoll_ctl(epoll, EPOLL_CTL_ADD, readers->done_event, &done);
+  }
 
-  /*
-  Determine which of the two nodes after the split should contain the child to be inserted,
-  and insert the child
-  */
-  uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+  InputBuffer* request = new_input_buffer();
+  ResultSink sink;
+  sink_init(&sink, OUTPUT_BINARY, -1);
+  Session* sessions = NULL;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  printf("Listening on %s\n", socket_path);
+  fflush(stdout);
+
+  while (!server_stopping) {
+    server_commit(database, epoll, &sessions);
+    int num_events = epoll_pwait(epoll, events, SERVER_MAX_EVENTS, -1, &wait_mask);
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error waiting for clients: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
 
-  uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+    for (int i = 0; i < num_events; i++) {
+      Session* session = events[i].data.ptr;
+      if (session == NULL) {
+        server_accept(listener, epoll, &sessions);
+        continue;
+      }
+      if (readers != NULL && events[i].data.ptr == readers) {
+        server_finish_reads(readers, epoll, &sessions, database, request, &sink);
+        continue;
+      }
+      /* A hang-up is reported even while nothing is watched */
+      bool open = !(events[i].events & (session->busy ? EPOLLERR | EPOLLHUP : EPOLLERR));
+      if (open && (events[i].events & EPOLLIN)) {
+        open = session_read(session, database, request, &sink, readers);
+      }
+      if (open) {
+        open = session_send(session);
+      }
+      if (!open) {
+        session_drop(session, epoll, &sessions);
+        continue;
+      }
+      session_watch(session, epoll);
+    }
+  }
 
-  internal_node_insert(table, destination_page_num, child_page_num);
-  *node_parent(child) = destination_page_num;
+  if (readers != NULL) {
+    reader_pool_stop(readers);
+  }
+  while (sessions) {
+    session_close(sessions, &sessions);
+  }
+  close(epoll);
+  close(listener);
+  unlink(socket_path);
+  close_input_buffer(request);
+  free(sink.buffer);
+}
 
-  update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+bool socket_write_all(int file_descriptor, const void* data, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_written = send(file_descriptor, data, length, MSG_NOSIGNAL);
+    if (bytes_written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_written == -1) {
+      return false;
+    }
+    data = (const char*)data + bytes_written;
+    length -= bytes_written;
+  }
+  return true;
+}
 
-  if (!splitting_root) {
-    internal_node_insert(table,*node_parent(old_node),new_page_num);
-    *node_parent(new_node) = *node_parent(old_node);
+bool socket_read_all(int file_descriptor, void* data, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_read = read(file_descriptor, data, length);
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      return false;
+    }
+    data = (char*)data + bytes_read;
+    length -= bytes_read;
   }
+  return true;
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-  /*
-  Create a new node and move half the cells over.
-  Insert the new value in one of the two nodes.
-  Update parent or create a new parent.
-  */
+int client_connect(const char* socket_path) {
+  struct sockaddr_un address = {0};
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+  int file_descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (file_descriptor == -1 ||
+      connect(file_descriptor, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    printf("Unable to connect to '%s': %d\n", socket_path, errno);
+    exit(EXIT_FAILURE);
+  }
+  return file_descriptor;
+}
 
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
+/*
+Sends one statement and waits for its response, whose payload is left in
+*data (grown as needed). Exits if the server goes away.
+*/
+ResponseStatus client_request(int file_descriptor, const char* text, char** data,
+                              uint32_t* length, uint32_t* capacity) {
+  uint32_t text_length = strlen(text);
+  uint8_t status;
+  if (!socket_write_all(file_descriptor, &text_length, sizeof(text_length)) ||
+      !socket_write_all(file_descriptor, text, text_length) ||
+      !socket_read_all(file_descriptor, &status, sizeof(status)) ||
+      !socket_read_all(file_descriptor, length, sizeof(*length))) {
+    printf("Lost the connection to the server.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (*length > *capacity) {
+    *capacity = *length;
+    *data = realloc(*data, *capacity);
+  }
+  if (!socket_read_all(file_descriptor, *data, *length)) {
+    printf("Lost the connection to the server.\n");
+    exit(EXIT_FAILURE);
+  }
+  return status;
+}
 
-  /*
-  All existing keys plus new key should should be divided
-  evenly between old (left) and new (right) nodes.
-  Starting from the right, move each key to correct position.
-  */
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void* destination_node;
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      destination_node = new_node;
+void* bench_client_main(void* argument) {
+  BenchClient* client = argument;
+  int file_descriptor = client_connect(client->socket_path);
+  uint32_t capacity = SERVER_READ_SIZE;
+  char* data = malloc(capacity);
+  uint32_t length;
+  uint32_t next_id = client->first_id;
+  char text[128];
+  for (uint32_t i = 0; i < client->num_requests; i++) {
+    if (client->max_read_id > 0 &&
+        (uint32_t)rand_r(&client->seed) % 100 < client->read_percent) {
+      snprintf(text, sizeof(text), "select where id = ? ; %u",
+               1 + (uint32_t)rand_r(&client->seed) % client->max_read_id);
+      client->reads++;
     } else {
-      destination_node = old_node;
+      snprintf(text, sizeof(text), "insert ? ? ? ; %u bench%u bench%u@example.com",
+               next_id, next_id, next_id);
+      next_id++;
     }
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* destination = leaf_node_cell(destination_node, index_within_node);
 
-    if (i == cursor->cell_num) {
-      serialize_row(value,
-                    leaf_node_value(destination_node, index_within_node));
-      *leaf_node_key(destination_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (client_request(file_descriptor, text, &data, &length, &capacity) !=
+        RESPONSE_OK) {
+      client->errors++;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    client->latencies[i] = (end.tv_sec - start.tv_sec) * 1000000000ull +
+                           (end.tv_nsec - start.tv_nsec);
   }
+  free(data);
+  close(file_descriptor);
+  return NULL;
+}
 
-  /* Update cell count on both leaf nodes */
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+/*
+Load generator: each client connection sends its requests one at a time,
+read_percent of them point selects of existing rows and the rest single-row
+inserts above the largest id. Reports throughput and latency percentiles.
+*/
+void run_bench(const char* socket_path, uint32_t num_clients, uint32_t num_requests,
+               uint32_t read_percent) {
+  int file_descriptor = client_connect(socket_path);
+  uint32_t capacity = SERVER_READ_SIZE;
+  char* data = malloc(capacity);
+  uint32_t length;
+  uint64_t max_id = 0;  // no response row for an empty table
+  if (client_request(file_descriptor, "select max(id)", &data, &length, &capacity) ==
+          RESPONSE_OK &&
+      length == sizeof(max_id)) {
+    memcpy(&max_id, data, sizeof(max_id));
+  }
+  free(data);
+  close(file_descriptor);
+
+  BenchClient* clients = calloc(num_clients, sizeof(BenchClient));
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < num_clients; i++) {
+    BenchClient* client = &clients[i];
+    client->socket_path = socket_path;
+    client->num_requests = num_requests;
+    client->read_percent = read_percent;
+    client->first_id = max_id + 1 + i * num_requests;
+    client->max_read_id = max_id;
+    client->latencies = malloc(sizeof(uint64_t) * num_requests);
+    client->seed = i + 1;
+    if (pthread_create(&client->thread, NULL, bench_client_main, client) != 0) {
+      printf("Unable to start client thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
+  uint64_t total = (uint64_t)num_clients * num_requests;
+  uint64_t* latencies = malloc(sizeof(uint64_t) * total);
+  uint32_t errors = 0;
+  uint64_t reads = 0;
+  for (uint32_t i = 0; i < num_clients; i++) {
+    pthread_join(clients[i].thread, NULL);
+    reads += clients[i].reads;
+    memcpy(latencies + (uint64_t)i * num_requests, clients[i].latencies,
+           sizeof(uint64_t) * num_requests);
+    errors += clients[i].errors;
+    free(clients[i].latencies);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(clients);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  qsort(latencies, total, sizeof(uint64_t), compare_uint64);
+  /* The real share: with no rows to read every request is an insert */
+  printf("Requests: %llu from %u clients (%.0f%% reads), %u errors\n",
+         (unsigned long long)total, num_clients, 100.0 * reads / total, errors);
+  printf("Throughput: %.0f requests/s\n", total / seconds);
+  printf("Latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+         latencies[total / 2] / 1e3, latencies[total * 99 / 100] / 1e3,
+         latencies[total - 1] / 1e3);
+  free(latencies);
+}
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+/* Runs one statement as the server would, exiting if it fails */
+void bench_execute(Database* database, InputBuffer* request, ResultSink* sink,
+                   const char* text) {
+  size_t text_length = strlen(text);
+  if (request->buffer_length < text_length + 1) {
+    request->buffer_length = text_length + 1;
+    request->buffer = realloc(request->buffer, request->buffer_length);
+  }
+  memcpy(request->buffer, text, text_length + 1);
+  request->input_length = text_length;
+  const char* response;
+  uint32_t length;
+  if (execute_request(database, request, sink, false, &response, &length) !=
+      RESPONSE_OK) {
+    printf("Error running '%s': %.*s\n", text, (int)length, response);
+    exit(EXIT_FAILURE);
   }
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
+double seconds_since(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    // Node full
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
+/*
+Benchmark for the shape of the tree: loads `num_rows` rows with odd ids
+into an empty table as .load would, then times num_rows / 10 point selects
+of loaded ids and as many single-row inserts of even ids, all in random
+order. Reports the depth the load built.
+*/
+void run_tree_bench(Database* database, uint32_t num_rows) {
+  Table* table = database_table(database, "");
+  pthread_mutex_lock(&database->pager->lock);
+  Cursor* cursor = table_start(table);
+  bool empty = cursor->end_of_table;
+  free(cursor);
+  pthread_mutex_unlock(&database->pager->lock);
+  if (!empty) {
+    printf("--bench-tree needs a new database file.\n");
+    exit(EXIT_FAILURE);
   }
 
-  if (cursor->cell_num < num_cells) {
-    // Make room for new cell
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    }
+  Row* rows = malloc(sizeof(Row) * num_rows);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    rows[i].id = 2 * i + 1;
+    snprintf(rows[i].username, sizeof(rows[i].username), "user%u", rows[i].id);
+    snprintf(rows[i].email, sizeof(rows[i].email), "user%u@example.com", rows[i].id);
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  load_rows(table, rows, num_rows, LOAD_DEFAULT_FILL_PERCENT);
+  double load_seconds = seconds_since(&start);
+  pthread_mutex_lock(&database->pager->lock);
+  uint32_t depth = table_depth(table);
+  pthread_mutex_unlock(&database->pager->lock);
+  printf("Loaded %u rows in %.2f s, depth %u\n", num_rows, load_seconds, depth);
+
+  uint32_t num_operations = num_rows / 10;
+  uint32_t* ids = malloc(sizeof(uint32_t) * num_rows);
+  unsigned int seed = 1;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    ids[i] = i + 1;
+  }
+  for (uint32_t i = num_rows - 1; i > 0; i--) {
+    uint32_t other = rand_r(&seed) % (i + 1);
+    uint32_t id = ids[i];
+    ids[i] = ids[other];
+    ids[other] = id;
   }
 
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
+  InputBuffer* request = new_input_buffer();
+  ResultSink sink;
+  sink_init(&sink, OUTPUT_BINARY, -1);
+  char text[128];
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < num_operations; i++) {
+    snprintf(text, sizeof(text), "select where id = %u", 2 * ids[i] - 1);
+    bench_execute(database, request, &sink, text);
+  }
+  printf("%u lookups: %.2f s\n", num_operations, seconds_since(&start));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < num_operations; i++) {
+    uint32_t id = 2 * ids[num_rows - 1 - i];
+    snprintf(text, sizeof(text), "insert %u user%u user%u@example.com", id, id, id);
+    bench_execute(database, request, &sink, text);
+  }
+  pager_commit(database->pager);
+  printf("%u inserts: %.2f s\n", num_operations, seconds_since(&start));
+  close_input_buffer(request);
+  free(sink.buffer);
+  free(ids);
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor* cursor = table_find(table, key_to_insert);
-
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+/*
+Benchmark for page compression: reports how much disk the file takes,
+then drops it from the OS cache and times a full select, whose rows go to
+/dev/null. The buffer pool starts out empty, so every page is read from
+the disk, and decompressed if it was stored compressed.
+*/
+void run_scan_bench(Database* database, const char* filename) {
+  struct stat file_stat;
+  if (stat(filename, &file_stat) == -1) {
+    printf("Unable to stat '%s': %d\n", filename, errno);
+    exit(EXIT_FAILURE);
+  }
+  printf("File: %.1f MB, %.1f MB allocated\n", file_stat.st_size / 1e6,
+         file_stat.st_blocks * 512 / 1e6);
+
+  posix_fadvise(database->pager->file_descriptor, 0, 0, POSIX_FADV_DONTNEED);
+  InputBuffer* request = new_input_buffer();
+  ResultSink sink;
+  sink_init(&sink, OUTPUT_BINARY, open("/dev/null", O_WRONLY | O_CLOEXEC));
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bench_execute(database, request, &sink, "select");
+  printf("Cold scan: %.2f s\n", seconds_since(&start));
+  close(sink.file_descriptor);
+  close_input_buffer(request);
+  free(sink.buffer);
+}
 
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
+/* Lower bound over (key, offset) pairs, the leaf layout before key_search */
+uint32_t bench_search_interleaved(const uint32_t* cells, uint32_t num_keys,
+                                  uint32_t key) {
+  uint32_t low = 0;
+  uint32_t high = num_keys;
+  while (low != high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (cells[2 * middle] < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
   }
-
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
+  return low;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table);
-
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
-    cursor_advance(cursor);
+/* Lower bound over contiguous keys by binary search alone, without SIMD */
+uint32_t bench_search_binary(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  uint32_t low = 0;
+  uint32_t high = num_keys;
+  while (low != high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (keys[middle] < key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
   }
+  return low;
+}
 
-  free(cursor);
+typedef uint32_t (*SearchFunction)(const uint32_t* keys, uint32_t num_keys,
+                                   uint32_t key);
 
-  return EXECUTE_SUCCESS;
-}
+/*
+Microbenchmark for key_search: BENCH_SEARCH_COUNT random lower-bound
+searches, each in one of BENCH_SEARCH_NODES nodes of `num_keys` keys.
+Compares interleaved (key, offset) cells, binary search over contiguous
+keys, and key_search, and reports nanoseconds per search.
+*/
+void run_search_bench(uint32_t num_keys) {
+  size_t total_keys = (size_t)BENCH_SEARCH_NODES * num_keys;
+  uint32_t* keys = malloc(sizeof(uint32_t) * total_keys);
+  uint32_t* cells = malloc(2 * sizeof(uint32_t) * total_keys);
+  unsigned int seed = 1;
+  uint32_t key = 0;
+  for (size_t i = 0; i < total_keys; i++) {
+    key = i % num_keys == 0 ? 0 : key + 1 + rand_r(&seed) % 64;
+    keys[i] = key;
+    cells[2 * i] = key;
+    cells[2 * i + 1] = i % num_keys;  // stands in for the record offset
+  }
+  uint32_t* nodes = malloc(sizeof(uint32_t) * BENCH_SEARCH_COUNT);
+  uint32_t* targets = malloc(sizeof(uint32_t) * BENCH_SEARCH_COUNT);
+  for (uint32_t i = 0; i < BENCH_SEARCH_COUNT; i++) {
+    nodes[i] = rand_r(&seed) % BENCH_SEARCH_NODES;
+    targets[i] = rand_r(&seed) % (num_keys * 33);  // past the last key at times
+  }
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-  switch (statement->type) {
-    case (STATEMENT_INSERT):
-      return execute_insert(statement, table);
-    case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+  const char* names[] = {"interleaved", "binary", "key_search"};
+  SearchFunction searches[] = {bench_search_interleaved, bench_search_binary,
+                               key_search};
+  double nanoseconds[3];
+  uint64_t checksums[3];
+  for (uint32_t method = 0; method < 3; method++) {
+    size_t stride = method == 0 ? 2 * num_keys : num_keys;
+    const uint32_t* data = method == 0 ? cells : keys;
+    uint64_t checksum = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < BENCH_SEARCH_COUNT; i++) {
+      checksum += searches[method](data + nodes[i] * stride, num_keys, targets[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nanoseconds[method] =
+        ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+        BENCH_SEARCH_COUNT;
+    checksums[method] = checksum;
   }
+  if (checksums[1] != checksums[0] || checksums[2] != checksums[0]) {
+    printf("Searches disagree for %u keys.\n", num_keys);
+    exit(EXIT_FAILURE);
+  }
+  printf("%u keys:", num_keys);
+  for (uint32_t method = 0; method < 3; method++) {
+    printf(" %s %.1f ns", names[method], nanoseconds[method]);
+  }
+  printf("\n");
+  free(keys);
+  free(cells);
+  free(nodes);
+  free(targets);
 }
 
 int main(int argc, char* argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "--bench-search") == 0) {
+    /* A 4 KB leaf before slotted pages, about a leaf now, 4 and 64 KB internal nodes */
+    uint32_t default_sizes[] = {13, 100, 510, 8190};
+    for (int i = 2; i < argc; i++) {
+      if (atoi(argv[i]) < 1) {
+        printf("Usage: --bench-search [keys per node]...\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (int i = 2; i < argc; i++) {
+      run_search_bench(atoi(argv[i]));
+    }
+    for (uint32_t i = 0; argc == 2 && i < 4; i++) {
+      run_search_bench(default_sizes[i]);
+    }
+    return 0;
+  }
+  if (argc >= 3 && strcmp(argv[1], "--bench") == 0) {
+    int num_clients = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_CLIENTS;
+    int num_requests = argc > 4 ? atoi(argv[4]) : BENCH_DEFAULT_REQUESTS;
+    int read_percent = argc > 5 ? atoi(argv[5]) : BENCH_DEFAULT_READ_PERCENT;
+    if (num_clients < 1 || num_requests < 1 || read_percent < 0 || read_percent > 100) {
+      printf("Usage: --bench <socket> [clients] [requests per client] [read percent]\n");
+      exit(EXIT_FAILURE);
+    }
+    run_bench(argv[2], num_clients, num_requests, read_percent);
+    return 0;
+  }
   if (argc < 2) {
     printf("Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
 
   char* filename = argv[1];
-  Table* table = db_open(filename);
+  char* socket_path = NULL;
+  uint32_t num_readers = 0;
+  uint32_t bench_rows = 0;
+  bool bench_scan = false;
+  PagerOptions options = {PAGER_BUFFERED, DEFAULT_POOL_FRAMES, true,
+                          WAL_DEFAULT_GROUP_SIZE, DEFAULT_PAGE_SIZE, false, false};
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      options.num_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.mode = PAGER_MMAP;
+      options.use_wal = false;  // stores reach the file through the mapping
+    } else if (strcmp(argv[i], "--no-wal") == 0) {
+      options.use_wal = false;
+    } else if (strcmp(argv[i], "--wal-group") == 0 && i + 1 < argc) {
+      options.wal_group_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+      num_readers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bench-scan") == 0) {
+      bench_scan = true;
+    } else if (strcmp(argv[i], "--bench-tree") == 0 && i + 1 < argc) {
+      bench_rows = atoi(argv[++i]);
+      if (bench_rows < 10) {
+        printf("Usage: <file> --bench-tree <rows, at least 10>\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (strcmp(argv[i], "--compress") == 0) {
+      options.compress_leaves = true;
+    } else if (strcmp(argv[i], "--compress-pages") == 0) {
+      options.compress_pages = true;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      options.page_size = atoi(argv[++i]);
+      if (!page_size_valid(options.page_size)) {
+        printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE,
+               MAX_PAGE_SIZE);
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      printf("Unknown option '%s'\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (bench_rows > 0 && bench_scan) {
+    printf("--bench-scan needs a run of its own, with the buffer pool empty.\n");
+    exit(EXIT_FAILURE);
+  }
+  Database* database = db_open(filename, &options);
+  if (bench_rows > 0 || bench_scan) {
+    if (bench_rows > 0) {
+      run_tree_bench(database, bench_rows);
+    } else {
+      run_scan_bench(database, filename);
+    }
+    db_close(database);
+    return 0;
+  }
+  if (socket_path != NULL) {
+    serve(database, socket_path, num_readers);
+    db_close(database);
+    return 0;
+  }
+  sink_init(&result_sink, OUTPUT_TABLE, STDOUT_FILENO);
 
   InputBuffer* input_buffer = new_input_buffer();
+  setvbuf(stdout, NULL, _IOFBF, REPL_OUTPUT_SIZE);
   while (true) {
     print_prompt();
-    read_input(input_buffer);
+    /* Statements read in one go share a commit, as long as none is waited on */
+    if (!input_pending(input_buffer)) {
+      repl_commit(database);
+    }
+    if (!read_input(input_buffer)) {
+      repl_commit(database);
+      printf("Error reading input\n");
+      exit(EXIT_FAILURE);
+    }
+    if (__fpending(stdout) + input_buffer->input_length + REPL_MESSAGE_ROOM >
+        REPL_OUTPUT_SIZE) {
+      repl_commit(database);
+    }
 
     if (input_buffer->buffer[0] == '.') {
-      switch (do_meta_command(input_buffer, table)) {
+      repl_commit(database);  // meta commands print freely, and may exit
+      switch (do_meta_command(input_buffer, database)) {
         case (META_COMMAND_SUCCESS):
           continue;
         case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -1029,31 +7068,28 @@ int main(int argc, char* argv[]) {
     }
 
     Statement statement;
-    switch (prepare_statement(input_buffer, &statement)) {
-      case (PREPARE_SUCCESS):
-        break;
-      case (PREPARE_NEGATIVE_ID):
-        printf("ID must be positive.\n");
-        continue;
-      case (PREPARE_STRING_TOO_LONG):
-        printf("String is too long.\n");
-        continue;
-      case (PREPARE_SYNTAX_ERROR):
-        printf("Syntax error. Could not parse statement.\n");
-        continue;
-      case (PREPARE_UNRECOGNIZED_STATEMENT):
-        printf("Unrecognized keyword at start of '%s'.\n",
-               input_buffer->buffer);
-        continue;
+    PrepareResult prepared = prepare_statement(input_buffer, &statement);
+    if (prepared == PREPARE_UNRECOGNIZED_STATEMENT) {
+      printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+      continue;
+    } else if (prepared != PREPARE_SUCCESS) {
+      printf("%s\n", prepare_result_message(prepared));
+      continue;
     }
 
-    switch (execute_statement(&statement, table)) {
-      case (EXECUTE_SUCCESS):
-        printf("Executed.\n");
-        break;
-      case (EXECUTE_DUPLICATE_KEY):
-        printf("Error: Duplicate key.\n");
-        break;
+    if (statement.type == STATEMENT_SELECT) {
+      repl_commit(database);  // its rows flush stdout on their way out
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ExecuteResult result = execute_statement(&statement, database, &result_sink);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close_statement(&statement);
+
+    printf("%s\n", execute_result_message(result));
+    if (timer_enabled) {
+      printf("Run Time: %.6f s\n", (end.tv_sec - start.tv_sec) +
+                                       (end.tv_nsec - start.tv_nsec) / 1e9);
     }
   }
 }